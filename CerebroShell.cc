@@ -9,11 +9,32 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+#ifdef CEREBRO_WITH_LLAMA
+#include <llama.h>
+#endif
+
 #include <pty.h>
+#include <termios.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <vector>
 #include <string>
@@ -22,7 +43,17 @@
 #include <cstring>
 #include <algorithm>
 #include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
 
 static std::atomic<bool> input_blocked(false); // when true, char input is ignored (used during AI confirm)
 
@@ -38,6 +69,34 @@ int ROWS = 24;
 const int FIRST_CHAR = 32;
 const int LAST_CHAR  = 126;
 
+static const char* AI_MODEL = "qwen2.5:7b";
+static const char* AI_KEEP_ALIVE = "30m"; // keep the model (and its prompt cache) resident
+const double AI_KEEP_ALIVE_PING = 600.0;  // seconds between keep-alive warm-ups while the window is open
+const double AI_COLD_LOAD_NS = 100e6;     // load_duration above this counts as a cold load
+const int AI_MAX_TOKENS = 128;            // generation cap for in-process backends
+const int RENDER_CPU = 0;                 // core in-process inference threads stay off (the render thread is not pinned)
+const double AI_SMALL_RETRY = 60.0;       // seconds before a failed small model is tried again (doubles, up to 16x)
+const uint32_t AI_CACHE_CAPACITY = 512; // persisted suggestions (LRU)
+const double AI_PREFETCH_DEBOUNCE = 0.6; // seconds of idle typing before speculating
+const float HISTORY_MATCH_CONFIDENCE = 0.8f; // local history answer is offered above this
+const int AI_MAX_CANDIDATES = 9;             // picked with 1-9 in the confirm prompt
+const double AI_HISTORY_BONUS = 0.5;         // ranking bonus per log(1 + times run)
+const int AI_FIX_CONTEXT_TOKENS = 256;       // output tail sent with "explain last failure"
+const size_t DOC_SNIPPET_BYTES = 200;        // man/--help paragraph kept per snippet
+const size_t DOC_MAX_SNIPPETS_PER_PAGE = 48;
+const size_t DOC_MAX_HELP_COMMANDS = 200;    // history commands indexed through --help
+const size_t DOC_TOP_K = 3;                  // snippets attached to a prompt
+const double DOC_INDEX_REFRESH = 3600.0;     // seconds between incremental rebuilds
+const double PREDICT_DIM_AFTER = 0.05;       // unconfirmed local echo is dimmed after this
+const double PREDICT_TIMEOUT = 1.0;          // and withdrawn after this
+const size_t PTY_INPUT_LIMIT = 1 << 20;      // queued PTY input above which bulk producers wait
+const double PASTE_FRAME_BUDGET = 0.008;     // seconds per frame spent streaming a paste
+const double INTERRUPT_DRAIN_BUDGET = 0.1;   // seconds per frame spent skipping output after ^C
+const int FLOOD_BACKLOG = 2048;              // waiting output (bytes; FIONREAD tops out near 4 KB) that switches to flood mode
+const double FLOOD_FRAME_BUDGET = 0.008;     // seconds per frame spent parsing a flood
+const double SYNC_UPDATE_TIMEOUT = 0.15;     // longest a synchronized update may hold the frame
+static int ai_candidates = 1;                // samples per request (CEREBRO_AI_CANDIDATES)
+
 // ---------- Glyph info ----------
 struct GlyphInfo {
     float ax, ay; // advance
@@ -65,11 +124,41 @@ Color ansi_basic_color(int idx){
 
 // ---------- Globals ----------
 static int master_fd = -1;
+static pid_t shell_pid = -1;
 static std::vector<std::string> termBuf;
 static std::vector<std::vector<Color>> termColor;
+static std::vector<std::string> altBuf;            // the screen not shown: alternate, or primary while a full-screen app runs
+static std::vector<std::vector<Color>> altColor;
 static int cursor_x = 0, cursor_y = 0;
 static Color cur_fg = {1,1,1};
 static Color cur_bg = {0,0,0};
+struct SavedCursor { int x = 0, y = 0; Color fg{1,1,1}, bg{0,0,0}; };
+static SavedCursor saved_cursor[2];                // DECSC / CSI s, per screen: [0] primary, [1] alternate
+static std::string last_command;       // last line sent with Enter (or accepted from the AI)
+static int last_command_row = -1;      // grid row it was entered on; -1 once scrolled away or cleared
+
+// DEC private modes set by the running program
+struct TermModes {
+    bool app_cursor = false;   // ?1   cursor keys send SS3
+    bool alt_screen = false;   // ?47 / ?1047 / ?1049
+    bool app_keypad = false;   // ESC = / ESC >, ?66   keypad sends SS3
+    int modify_other_keys = 0; // CSI > 4 ; n m
+    bool bracketed_paste = false; // ?2004
+    bool sync_update = false;  // ?2026 synchronized output
+};
+static TermModes term_modes;
+
+// Predictive local echo: typed characters drawn before the PTY echoes them
+struct PredictedCell {
+    int row, col;
+    char ch;
+    char prev_ch;              // cell contents to restore on a wrong guess
+    Color prev_color;
+    double at;
+    bool dimmed;
+};
+static std::vector<PredictedCell> predictions; // oldest first, along one row
+static bool predictive_echo = true;            // CEREBRO_PREDICT=0 disables
 
 // FreeType & GL atlas
 static int ATLAS_W = 2048, ATLAS_H = 2048;
@@ -84,10 +173,22 @@ static GLint uniTex  = -1;
 
 // --- AI / input buffer Globals ---
 static std::string shell_buffer;       // authoritative buffer of what will be sent to shell on Enter
+static bool local_line_active = false; // shell_buffer holds locally edited, unsent (hidden) input
 static std::string ai_result = "";     // raw AI text when ready
 static bool ai_ready = false;
 static std::mutex ai_mutex;
+static std::vector<std::string> ai_alternatives; // further ranked candidates with ai_result
+static const char* ai_origin = "";     // "" (model), "cached" or "history"
+static std::string ai_result_key = "";  // cache key ai_result is stored under, "" if none
 static std::string pending_ai_cmd = "";
+static std::vector<std::string> pending_ai_cmds; // pending_ai_cmd followed by its alternatives
+static std::string pending_ai_request = ""; // request text that produced pending_ai_cmd
+static std::string pending_ai_key = "";     // cache key of pending_ai_cmd, erased if it is declined
+static std::string ai_last_rejected = "";   // normalized request whose suggestion was just declined
+static double ai_request_started = 0;       // Shift+Enter time of the current request
+static double ai_shown_at = 0;              // when the pending suggestion was displayed
+static std::string ai_request_text = "";    // request text of the last Shift+Enter
+static uint64_t ai_generation = 0;          // bumped per request and per y/n; stale results are dropped
 static bool awaiting_confirm = false;
 
 // ------- Shaders -------
@@ -194,22 +295,86 @@ static void clear_screen(){
         termColor[r].assign(COLS, Color{1,1,1});
     }
     cursor_x = cursor_y = 0;
+    if(!term_modes.alt_screen) last_command_row = -1;
+}
+
+static void save_cursor(){
+    saved_cursor[term_modes.alt_screen] = SavedCursor{cursor_x, cursor_y, cur_fg, cur_bg};
+}
+static void restore_cursor(){
+    const SavedCursor &c = saved_cursor[term_modes.alt_screen];
+    cursor_x = std::min(c.x, COLS-1); cursor_y = std::min(c.y, ROWS-1);
+    cur_fg = c.fg; cur_bg = c.bg;
+}
+
+// Alternate screen (?47, ?1047, ?1049). Both grids stay allocated and trade
+// places with vector::swap, so entering or leaving vim or less moves no rows and
+// the primary screen comes back untouched. clear_alt blanks the alternate grid
+// in place (on entry for ?1049, on exit for ?1047); with_cursor saves the
+// cursor on entry and restores it on exit (?1049).
+static void set_alt_screen(bool on, bool with_cursor, bool clear_alt){
+    if(on == term_modes.alt_screen) return;
+    if(altBuf.size() != termBuf.size()){ // normally preallocated in main()
+        altBuf.assign(ROWS, std::string(COLS, ' '));
+        altColor.assign(ROWS, std::vector<Color>(COLS, Color{1,1,1}));
+    }
+    auto blank = [](){
+        for(int r=0;r<ROWS;++r){
+            std::fill(termBuf[r].begin(), termBuf[r].end(), ' ');
+            std::fill(termColor[r].begin(), termColor[r].end(), Color{1,1,1});
+        }
+    };
+    if(on && with_cursor) save_cursor();
+    if(!on && clear_alt) blank();
+    termBuf.swap(altBuf);
+    termColor.swap(altColor);
+    term_modes.alt_screen = on;
+    if(on && clear_alt) blank();
+    if(!on && with_cursor) restore_cursor();
 }
 static void clear_line_from(int row,int col){
     if(row<0 || row>=ROWS) return;
     for(int c=col;c<COLS;++c){ termBuf[row][c] = ' '; termColor[row][c] = cur_fg; }
 }
+// Undo unconfirmed predictions, newest first.
+static void predict_rollback(){
+    for(auto it = predictions.rbegin(); it != predictions.rend(); ++it){
+        if(it->row < 0 || it->row >= ROWS) continue;
+        termBuf[it->row][it->col] = it->prev_ch;
+        termColor[it->row][it->col] = it->prev_color;
+    }
+    predictions.clear();
+}
+
+// Program output at the cursor: confirms the oldest prediction or refutes all.
+static void predict_reconcile(char ch){
+    const PredictedCell &p = predictions.front();
+    if(p.row == cursor_y && p.col == cursor_x && p.ch == ch) predictions.erase(predictions.begin());
+    else predict_rollback();
+}
+
+// Cursor moved past the last row: rotate the rows up instead of reallocating one per line.
+static void scroll_up(){
+    std::rotate(termBuf.begin(), termBuf.begin() + 1, termBuf.end());
+    std::rotate(termColor.begin(), termColor.begin() + 1, termColor.end());
+    termBuf.back().assign(COLS, ' ');
+    termColor.back().assign(COLS, Color{1,1,1});
+    cursor_y = ROWS-1;
+    if(last_command_row >= 0 && !term_modes.alt_screen) last_command_row--;
+    for(PredictedCell &p : predictions) p.row--;
+}
+
 // Put a single char into the current cursor position (visual only) and advance cursor.
 static void put_char_local(char ch){
     if(ch=='\r') return;
+    if(!predictions.empty()){
+        if(ch == '\n' || ch == '\t' || ch == 0x7f || ch == '\b') predict_rollback();
+        else predict_reconcile(ch);
+    }
     if(ch=='\n'){
         cursor_x = 0; cursor_y++;
         if(cursor_y >= ROWS){
-            termBuf.erase(termBuf.begin());
-            termColor.erase(termColor.begin());
-            termBuf.emplace_back(std::string(COLS,' '));
-            termColor.emplace_back(std::vector<Color>(COLS, Color{1,1,1}));
-            cursor_y = ROWS-1;
+            scroll_up();
         }
         return;
     }
@@ -234,11 +399,7 @@ static void put_char_local(char ch){
     if(cursor_x >= COLS){
         cursor_x = 0; cursor_y++;
         if(cursor_y >= ROWS){
-            termBuf.erase(termBuf.begin());
-            termColor.erase(termColor.begin());
-            termBuf.emplace_back(std::string(COLS,' '));
-            termColor.emplace_back(std::vector<Color>(COLS, Color{1,1,1}));
-            cursor_y = ROWS-1;
+            scroll_up();
         }
     }
 }
@@ -253,7 +414,26 @@ static void handle_csi_sequence(const std::string &seq){
     if(seq.empty()) return;
     char final_byte = seq.back();
     std::string params = seq.substr(0, seq.size()-1);
-    if(final_byte == 'm'){ // SGR
+    if(final_byte != 'm') predict_rollback(); // the program is redrawing: restore the cells, its output wins
+    if((final_byte == 'h' || final_byte == 'l') && !params.empty() && params[0] == '?'){ // DEC private modes
+        bool on = final_byte == 'h';
+        std::stringstream ss(params.substr(1)); std::string item;
+        while(std::getline(ss, item, ';')){
+            int mode = atoi(item.c_str());
+            if(mode == 1) term_modes.app_cursor = on;
+            else if(mode == 66) term_modes.app_keypad = on;
+            else if(mode == 2004) term_modes.bracketed_paste = on;
+            else if(mode == 2026) term_modes.sync_update = on;
+            else if(mode == 47) set_alt_screen(on, false, false);
+            else if(mode == 1047) set_alt_screen(on, false, !on);
+            else if(mode == 1049) set_alt_screen(on, true, on);
+        }
+    } else if(final_byte == 'm' && !params.empty() && params[0] == '>'){ // xterm key modifier options
+        if(atoi(params.c_str() + 1) == 4){
+            size_t semi = params.find(';');
+            term_modes.modify_other_keys = semi == std::string::npos ? 0 : atoi(params.c_str() + semi + 1);
+        }
+    } else if(final_byte == 'm'){ // SGR
         if(params.empty()) params = "0";
         std::stringstream ss(params); std::string item; std::vector<int> codes;
         while(std::getline(ss, item, ';')){
@@ -271,6 +451,9 @@ static void handle_csi_sequence(const std::string &seq){
             else if(code == 49){ cur_bg = Color{0,0,0}; }
             // ignore extended colors
         }
+    } else if((final_byte == 's' || final_byte == 'u') && params.empty()){ // save / restore cursor
+        if(final_byte == 's') save_cursor();
+        else restore_cursor();
     } else if(final_byte == 'H' || final_byte == 'f'){ // cursor position
         int row=1,col=1;
         if(!params.empty()){
@@ -298,7 +481,12 @@ static void process_byte_ansi(char ch){
     } else if(pstate == PS_ESC){
         if(ch == '['){ pstate = PS_CSI; esc_buf.clear(); }
         else if(ch == ']'){ pstate = PS_OSC; osc_buf.clear(); }
-        else pstate = PS_NORMAL;
+        else {
+            if(ch == '=' || ch == '>') term_modes.app_keypad = ch == '=';
+            else if(ch == '7') save_cursor();
+            else if(ch == '8') restore_cursor();
+            pstate = PS_NORMAL;
+        }
     } else if(pstate == PS_CSI){
         esc_buf.push_back(ch);
         unsigned char u = (unsigned char)ch;
@@ -315,8 +503,18 @@ static void process_byte_ansi(char ch){
 }
 
 // ---------- PTY read ----------
-static void read_master(){
-    if(master_fd < 0) return;
+// One read's worth of output; false when nothing was waiting.
+// The shell side of the PTY is gone.
+static void pty_closed(){
+    std::string msg = "[shell closed]";
+    for(char c : msg) process_byte_ansi(c);
+    process_byte_ansi('\n');
+    close(master_fd);
+    master_fd = -1;
+}
+
+static bool read_master(){
+    if(master_fd < 0) return false;
     fd_set rf; FD_ZERO(&rf); FD_SET(master_fd, &rf);
     timeval tv = {0,0};
     int r = select(master_fd+1, &rf, NULL, NULL, &tv);
@@ -325,19 +523,86 @@ static void read_master(){
         ssize_t n = read(master_fd, buf, sizeof(buf));
         if(n > 0){
             for(ssize_t i=0;i<n;++i) process_byte_ansi(buf[i]);
-        } else if(n == 0){
-            std::string msg = "[shell closed]";
-            for(char c : msg) process_byte_ansi(c);
-            process_byte_ansi('\n');
-            close(master_fd);
-            master_fd = -1;
+        } else if(n == 0 || (errno != EAGAIN && errno != EINTR)){
+            pty_closed(); // Linux reports a hung-up master as EIO, not EOF
         }
+        return n > 0;
     }
+    return false;
 }
 
-static void send_key_to_pty(const std::string &s){
+// ---------- PTY write ----------
+// Input produced while handling one batch of window events is collected here
+// and written once per frame, right after glfwPollEvents, so key repeat or fast
+// typing costs one write(2) per frame rather than one per key. Everything goes
+// through the same queue in order, so ^C never overtakes earlier input.
+// master_fd is non-blocking: whatever the tty does not take (EAGAIN, short
+// write) stays queued for the next frame. Bulk producers (paste) check
+// pty_input_room() and hold back while the queue is full, so the render loop
+// never blocks and nothing is cut off mid-stream. Keystrokes and accepted
+// commands are always queued, whatever the queue holds.
+static std::string pty_input;
+static size_t pty_input_sent = 0; // prefix of pty_input already written
+static size_t paste_queue_begin = 0, paste_queue_end = 0; // unwritten paste bytes in pty_input (see paste_queue)
+// clipboard paste being streamed (see paste_tick)
+static std::string paste_data;
+static size_t paste_sent = 0;
+static bool paste_bracketed = false;
+static bool paste_end_pending = false;
+
+struct PtyMetrics {
+    uint64_t sends = 0;   // send_key_to_pty calls (keys, accepted commands, ...)
+    uint64_t writes = 0;  // write(2) calls on master_fd
+    uint64_t bytes = 0;
+    uint64_t full = 0;    // writes refused with EAGAIN or cut short
+    size_t max_queued = 0;
+    uint64_t flood_frames = 0; // frames that parsed a backlog under FLOOD_FRAME_BUDGET
+    uint64_t held_frames = 0;  // frames redrawn unchanged during a synchronized update
+};
+static PtyMetrics pty_metrics;
+
+static size_t pty_input_queued(){ return pty_input.size() - pty_input_sent; }
+static size_t pty_input_room(){ return PTY_INPUT_LIMIT - std::min(PTY_INPUT_LIMIT, pty_input_queued()); }
+
+static void send_key_to_pty(const char *p, size_t n){
     if(master_fd < 0) return;
-    write(master_fd, s.c_str(), s.size());
+    pty_input.append(p, n);
+    pty_metrics.sends++;
+    pty_metrics.max_queued = std::max(pty_metrics.max_queued, pty_input_queued());
+}
+
+static void send_key_to_pty(const std::string &s){
+    send_key_to_pty(s.data(), s.size());
+}
+
+// No shell to write to: drop queued input and any paste in progress.
+static void pty_input_drop(){
+    pty_input.clear();
+    pty_input_sent = 0;
+    paste_queue_begin = paste_queue_end = 0;
+    paste_data.clear();
+    paste_sent = 0;
+    paste_end_pending = false;
+}
+
+// Write as much of the queue as the tty takes without blocking.
+static void flush_pty_input(){
+    if(master_fd < 0){ pty_input_drop(); return; }
+    while(pty_input_queued()){
+        ssize_t n = write(master_fd, pty_input.data() + pty_input_sent, pty_input_queued());
+        pty_metrics.writes++;
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && errno != EAGAIN){ pty_closed(); pty_input_drop(); return; } // EIO: the shell is gone
+        if(n > 0){ pty_input_sent += (size_t)n; pty_metrics.bytes += (uint64_t)n; }
+        if(pty_input_queued()){ pty_metrics.full++; break; }
+    }
+    if(pty_input_sent == pty_input.size()){ pty_input.clear(); pty_input_sent = 0; paste_queue_begin = paste_queue_end = 0; }
+    else if(pty_input_sent > pty_input.size() / 2){
+        pty_input.erase(0, pty_input_sent);
+        paste_queue_begin -= std::min(paste_queue_begin, pty_input_sent);
+        paste_queue_end -= std::min(paste_queue_end, pty_input_sent);
+        pty_input_sent = 0;
+    }
 }
 
 // ---------- Helper: shell-escape single quotes ----------
@@ -354,275 +619,3617 @@ static std::string shell_escape_single_quotes(const std::string &s){
     return out;
 }
 
-// ---------- AI: run Ollama blocking (safe) ----------
-static std::string run_llm_blocking(const std::string& prompt){
-    // uses qwen2.5:7b (ollama must be running and model pulled)
-    std::string esc = shell_escape_single_quotes(prompt);
-    std::string cmd = "echo '" + esc + "' | ollama run qwen2.5:7b 2>/dev/null";
-    std::string out;
-    FILE *p = popen(cmd.c_str(), "r");
-    if(!p) return "[AI error: popen failed]";
-    char buf[4096];
-    while(fgets(buf, sizeof(buf), p)){
-        out += buf;
-    }
-    int rc = pclose(p);
-    (void)rc;
-    return out;
+// ---------- AI metrics ----------
+static double now_sec(){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-static void run_llm_async(const std::string &input_line){
-    std::thread([input_line](){
-        std::string prompt = "You are a shell assistant. Produce a single valid bash command (no explanations, no extra text) that matches the user's request.\nUser request: " + input_line + "\nCommand:";
-        std::string out = run_llm_blocking(prompt);
-        while(!out.empty() && (out.back()=='\n' || out.back()=='\r' || out.back()==' ' || out.back()=='\t')) out.pop_back();
-        std::string cmdline;
-        {
-            std::istringstream ss(out);
-            while(std::getline(ss, cmdline)){
-                if(!cmdline.empty()) break;
-            }
-        }
-        if(cmdline.empty()) cmdline = out;
-        {
-            std::lock_guard<std::mutex> g(ai_mutex);
-            ai_result = cmdline;
-            ai_ready = true;
-        }
-    }).detach();
-}
+// HDR-style log-linear histogram: exact below 32, then 16 sub-buckets per power
+// of two (<= 6.25% relative error). Lock-free so worker threads can record.
+struct Histogram {
+    static const int BUCKETS = 32 + 59 * 16;
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> n{0}, max{0};
 
-// ---------- Input helpers to update shell_buffer and visual line ----------
-static void append_to_shell_buffer(char ch){
-    shell_buffer.push_back(ch);
-    put_char_local(ch); // visual
-}
-static void shell_backspace(){
-    if(!shell_buffer.empty()){
-        shell_buffer.pop_back();
-        // visual backspace: move cursor back and clear char
-        if(cursor_x>0){
-            cursor_x--;
-            termBuf[cursor_y][cursor_x] = ' ';
-            termColor[cursor_y][cursor_x] = cur_fg;
+    static int index_of(uint64_t v){
+        if(v < 32) return (int)v;
+        int msb = 63 - __builtin_clzll(v);
+        return 32 + (msb - 5) * 16 + (int)((v >> (msb - 4)) & 15);
+    }
+    static uint64_t value_of(int idx){ // midpoint of the bucket
+        if(idx < 32) return (uint64_t)idx;
+        int msb = (idx - 32) / 16 + 5;
+        uint64_t lo = (uint64_t)(16 + (idx - 32) % 16) << (msb - 4);
+        return lo + ((1ull << (msb - 4)) >> 1);
+    }
+    void record(uint64_t v){
+        counts[index_of(v)].fetch_add(1, std::memory_order_relaxed);
+        n.fetch_add(1, std::memory_order_relaxed);
+        uint64_t m = max.load(std::memory_order_relaxed);
+        while(v > m && !max.compare_exchange_weak(m, v, std::memory_order_relaxed)){}
+    }
+    uint64_t percentile(double p) const {
+        uint64_t total = n.load(), seen = 0;
+        if(!total) return 0;
+        uint64_t want = std::max<uint64_t>(1, (uint64_t)std::ceil(p / 100.0 * total));
+        for(int i=0;i<BUCKETS;++i){
+            seen += counts[i].load(std::memory_order_relaxed);
+            if(seen >= want) return std::min(value_of(i), max.load());
         }
+        return max.load();
     }
+};
+
+struct AiMetrics {
+    // microseconds unless noted
+    Histogram queue_wait;      // Shift+Enter -> worker starts on it
+    Histogram ttft;            // backend call -> first token
+    Histogram generation;      // backend call -> last token
+    Histogram tokens_per_sec;  // tokens/s
+    Histogram to_suggestion;   // Shift+Enter -> suggestion on screen
+    Histogram decision;        // suggestion on screen -> y/n
+    Histogram model_load;      // cold model loads (warm-up or a request that paid one)
+    Histogram lint;            // local safety check of the shown suggestions
+    Histogram doc_lookup;      // man/--help snippet retrieval
+    std::atomic<uint64_t> requests{0}, history_hits{0}, model_calls{0};
+    std::atomic<uint64_t> accepted{0}, rejected{0}, picked_alternative{0};
+    std::atomic<uint64_t> route[4] = {};  // per AiRoute
+    Histogram route_latency[4];           // request -> ranked commands, per AiRoute
+};
+static AiMetrics ai_metrics;
+static Histogram interrupt_drain; // ^C -> output backlog parsed (us)
+static std::atomic<bool> metrics_dump_requested(false); // set from SIGUSR1
+
+static void record_us(Histogram &h, double seconds){
+    h.record((uint64_t)std::max(0.0, seconds * 1e6));
 }
-static void clear_input_line_visual_and_buffer(){
-    // clear visual characters on current line
-    for(int c=0;c<COLS;++c) termBuf[cursor_y][c] = ' ';
-    // reset cursor_x
-    cursor_x = 0;
-    shell_buffer.clear();
+
+static std::vector<std::string> ai_metrics_report(){
+    std::vector<std::string> lines;
+    char buf[256];
+    const AiMetrics &m = ai_metrics;
+    uint64_t decided = m.accepted.load() + m.rejected.load();
+    snprintf(buf, sizeof(buf), "[AI metrics] requests %llu, history hits %llu, model calls %llu, accepted %llu / rejected %llu (%.0f%% accept, %llu alternatives picked)",
+             (unsigned long long)m.requests.load(), (unsigned long long)m.history_hits.load(), (unsigned long long)m.model_calls.load(),
+             (unsigned long long)m.accepted.load(), (unsigned long long)m.rejected.load(),
+             decided ? 100.0 * m.accepted.load() / decided : 0.0, (unsigned long long)m.picked_alternative.load());
+    lines.push_back(buf);
+    auto hist = [&](const char* name, const Histogram &h, double scale, const char* unit){
+        snprintf(buf, sizeof(buf), "  %-15s n=%-6llu p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f %s", name, (unsigned long long)h.n.load(),
+                 h.percentile(50) * scale, h.percentile(90) * scale, h.percentile(99) * scale, h.max.load() * scale, unit);
+        lines.push_back(buf);
+    };
+    hist("queue wait", m.queue_wait, 1e-3, "ms");
+    hist("first token", m.ttft, 1e-3, "ms");
+    hist("generation", m.generation, 1e-3, "ms");
+    hist("tokens/sec", m.tokens_per_sec, 1.0, "tok/s");
+    hist("to suggestion", m.to_suggestion, 1e-3, "ms");
+    hist("decision", m.decision, 1e-3, "ms");
+    hist("model load", m.model_load, 1e-3, "ms");
+    hist("safety check", m.lint, 1.0, "us");
+    hist("doc lookup", m.doc_lookup, 1.0, "us");
+    static const char* routes[4] = {"small model", "large/complex", "large/better", "escalated"};
+    for(int r=0;r<4;++r) if(m.route[r].load()) hist(routes[r], m.route_latency[r], 1e-3, "ms");
+    return lines;
 }
 
-// ---------- Input callbacks ----------
-static void char_callback(GLFWwindow*, unsigned int codepoint){
-    // codepoint is a Unicode scalar value; we only handle ASCII printable here
-    if(input_blocked.load()) return; // ignore while awaiting confirm or blocked
+// ---------- AI suggestion cache (persistent LRU) ----------
+// Fixed-size records in a MAP_SHARED file so a restart can use them without parsing.
+// Every window maps the same file: accesses hold flock(LOCK_EX) on it, and each
+// process rebuilds its in-memory index whenever hdr->clock shows that another
+// one has touched the records since.
+struct AiCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    uint64_t clock;      // last LRU stamp handed out; bumped by every change
+    uint8_t pad[40];
+};
+struct AiCacheRecord {
+    uint64_t hash;       // 0 == free slot
+    uint64_t stamp;      // LRU stamp, higher == more recently used
+    uint16_t key_len, cmd_len;
+    uint32_t reserved;
+    char key[500];       // model \0 cwd \0 normalized request
+    char cmd[500];
+};
+static_assert(sizeof(AiCacheHeader) == 64, "cache header layout");
+static_assert(sizeof(AiCacheRecord) == 1024, "cache record layout");
 
-    if(codepoint < 128){
-        char ch = (char)codepoint;
-        if(ch == '\r' || ch == '\n') return; // handled in key_callback
-        if(ch == 0x7f) { shell_backspace(); return; }
-        // append to local buffer & visual
-        append_to_shell_buffer(ch);
-    } else {
-        // show ? for non-ascii (simple fallback)
-        append_to_shell_buffer('?');
+struct AiCache {
+    std::mutex mtx;
+    AiCacheHeader* hdr = nullptr;
+    AiCacheRecord* recs = nullptr;
+    size_t map_len = 0;
+    int fd = -1;                                  // the shared file, for flock; -1 when private
+    uint64_t synced = 0;                          // hdr->clock the index below reflects
+    std::unordered_map<uint64_t, uint32_t> index; // hash -> slot
+    std::list<uint32_t> lru;                      // front == most recent
+    std::vector<std::list<uint32_t>::iterator> lru_pos;
+    std::atomic<uint64_t> hits{0}, misses{0};
+};
+static AiCache ai_cache;
+
+static uint64_t fnv1a64(const std::string &s){
+    uint64_t h = 1469598103934665603ull;
+    for(unsigned char c : s){ h ^= c; h *= 1099511628211ull; }
+    return h ? h : 1;
+}
+
+// lowercase, collapse whitespace, drop trailing punctuation
+static std::string normalize_ai_request(const std::string &s){
+    std::string out;
+    out.reserve(s.size());
+    for(char c : s){
+        unsigned char u = (unsigned char)c;
+        if(std::isspace(u)){ if(!out.empty() && out.back() != ' ') out.push_back(' '); }
+        else out.push_back((char)std::tolower(u));
     }
+    while(!out.empty() && (out.back()==' ' || out.back()=='?' || out.back()=='.' || out.back()=='!')) out.pop_back();
+    return out;
 }
 
-static void key_callback(GLFWwindow* window, int key, int, int action, int mods)
-{
-    if (!(action == GLFW_PRESS || action == GLFW_REPEAT)) return;
+static std::string shell_cwd(){
+    if(shell_pid <= 0) return "";
+    char path[64], buf[4096];
+    snprintf(path, sizeof(path), "/proc/%d/cwd", (int)shell_pid);
+    ssize_t n = readlink(path, buf, sizeof(buf)-1);
+    if(n <= 0) return "";
+    return std::string(buf, (size_t)n);
+}
 
-    // ============================================================
-    // 1. Awaiting confirmation (AI suggestion)
-    // ============================================================
-    if (awaiting_confirm)
-    {
-        if (key == GLFW_KEY_Y || key == GLFW_KEY_N)
-        {
-            bool yes = (key == GLFW_KEY_Y);
+// What a request asks, independent of the model: cwd \0 normalized request.
+// In-flight requests are joined on this.
+static std::string ai_request_key(const std::string &request){
+    std::string key = shell_cwd();
+    key.push_back('\0'); key += normalize_ai_request(request);
+    return key;
+}
 
-            {
-                std::lock_guard<std::mutex> lock(ai_mutex);
+// model_id: identity of the model that answers (AiBackend::model_id).
+static std::string ai_cache_key(const std::string &model_id, const std::string &request_key){
+    std::string key = model_id;
+    key.push_back('\0'); key += request_key;
+    return key;
+}
 
-                if (yes)
-                {
-                    // -------------------------------
-                    // User accepts AI-generated cmd
-                    // -------------------------------
-                    if (!pending_ai_cmd.empty())
-                    {
-                        // Send to PTY
-                        send_key_to_pty(pending_ai_cmd + "\n");
+static std::string cache_dir(){
+    std::string dir;
+    if(const char* x = getenv("XDG_CACHE_HOME")) dir = x;
+    else if(const char* h = getenv("HOME")) dir = std::string(h) + "/.cache";
+    if(dir.empty()) return "";
+    mkdir(dir.c_str(), 0755);
+    dir += "/cerebroshell";
+    mkdir(dir.c_str(), 0755);
+    return dir;
+}
 
-                        // Clear current visual line
-                        clear_input_line_visual_and_buffer();
+static std::string ai_cache_path(){
+    std::string dir = cache_dir();
+    return dir.empty() ? "" : dir + "/ai_cache.bin";
+}
 
-                        // Print the command visually
-                        for (char c : pending_ai_cmd) process_byte_ansi(c);
-                        process_byte_ansi('\n');
+// Rebuild the in-memory index from the records, most recent first. Caller holds
+// the file lock (or is the only user).
+static void ai_cache_reindex(){
+    AiCache &c = ai_cache;
+    std::vector<uint32_t> used;
+    for(uint32_t i=0;i<AI_CACHE_CAPACITY;++i) if(c.recs[i].hash) used.push_back(i);
+    std::sort(used.begin(), used.end(), [&](uint32_t a, uint32_t b){ return c.recs[a].stamp > c.recs[b].stamp; });
+    c.index.clear();
+    c.lru.clear();
+    c.lru_pos.assign(AI_CACHE_CAPACITY, c.lru.end());
+    for(uint32_t i : used){
+        const AiCacheRecord &r = c.recs[i];
+        bool torn = r.key_len > sizeof(r.key) || r.cmd_len > sizeof(r.cmd) || r.cmd_len == 0;
+        if(torn || c.index.count(r.hash)){ c.recs[i].hash = 0; continue; }
+        c.index[c.recs[i].hash] = i;
+        c.lru_pos[i] = c.lru.insert(c.lru.end(), i);
+    }
+    c.synced = c.hdr->clock;
+}
 
-                        // Note message
-                        std::string note = "[AI executed] " + pending_ai_cmd;
-                        for (char c : note) process_byte_ansi(c);
-                        process_byte_ansi('\n');
-                    }
-                }
-                else
-                {
-                    // -------------------------------
-                    // User CANCELLED AI suggestion
-                    // -------------------------------
-                    std::string note = "[AI cancelled]";
-                    for (char c : note) process_byte_ansi(c);
-                    process_byte_ansi('\n');
+// Holds flock on the cache file for one access and brings the index up to date
+// with changes other processes made. Caller holds ai_cache.mtx.
+struct AiCacheFileLock {
+    AiCache &c;
+    explicit AiCacheFileLock(AiCache &cache) : c(cache) {
+        if(c.fd >= 0) flock(c.fd, LOCK_EX);
+        if(c.hdr && c.hdr->clock != c.synced) ai_cache_reindex();
+    }
+    ~AiCacheFileLock(){
+        if(c.hdr) c.synced = c.hdr->clock;
+        if(c.fd >= 0) flock(c.fd, LOCK_UN);
+    }
+};
 
-                    // Send Ctrl+C to reset the prompt
-                    send_key_to_pty(std::string(1, 3)); // ASCII 3 == ^C
+static void ai_cache_open(){
+    AiCache &c = ai_cache;
+    c.map_len = sizeof(AiCacheHeader) + sizeof(AiCacheRecord) * AI_CACHE_CAPACITY;
+    void* mem = MAP_FAILED;
+    std::string path = ai_cache_path();
+    int fd = path.empty() ? -1 : open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd >= 0){
+        flock(fd, LOCK_EX);
+        struct stat st;
+        if(fstat(fd, &st) == 0 && (st.st_size == (off_t)c.map_len || ftruncate(fd, (off_t)c.map_len) == 0))
+            mem = mmap(nullptr, c.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(mem == MAP_FAILED){ close(fd); fd = -1; }
+    }
+    if(mem == MAP_FAILED){
+        // no writable cache dir: keep an in-memory cache for this session
+        mem = mmap(nullptr, c.map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED){ c.map_len = 0; return; }
+    }
+    c.hdr = (AiCacheHeader*)mem;
+    c.recs = (AiCacheRecord*)((char*)mem + sizeof(AiCacheHeader));
+    if(memcmp(c.hdr->magic, "CRBAIC01", 8) != 0 || c.hdr->version != 1 || c.hdr->capacity != AI_CACHE_CAPACITY){
+        memset(mem, 0, c.map_len);
+        memcpy(c.hdr->magic, "CRBAIC01", 8);
+        c.hdr->version = 1;
+        c.hdr->capacity = AI_CACHE_CAPACITY;
+    }
+    ai_cache_reindex();
+    if(fd >= 0) flock(fd, LOCK_UN);
+    c.fd = fd;
+}
 
-                    // Visual ^C (optional)
-                    process_byte_ansi('^');
-                    process_byte_ansi('C');
-                    process_byte_ansi('\n');
-                }
+static void ai_cache_close(){
+    if(!ai_cache.hdr) return;
+    munmap(ai_cache.hdr, ai_cache.map_len);
+    ai_cache.hdr = nullptr; ai_cache.recs = nullptr;
+    if(ai_cache.fd >= 0){ close(ai_cache.fd); ai_cache.fd = -1; }
+}
 
-                pending_ai_cmd.clear();
-            }
+// count_miss: false for a probe that is followed by another lookup
+static bool ai_cache_lookup(const std::string &key, std::string &cmd_out, bool count_miss = true){
+    AiCache &c = ai_cache;
+    std::lock_guard<std::mutex> g(c.mtx);
+    if(!c.hdr){ c.misses += count_miss; return false; }
+    AiCacheFileLock lock(c);
+    auto it = c.index.find(fnv1a64(key));
+    if(it == c.index.end()){ c.misses += count_miss; return false; }
+    AiCacheRecord &r = c.recs[it->second];
+    if(r.key_len != key.size() || memcmp(r.key, key.data(), key.size()) != 0){ c.misses += count_miss; return false; }
+    r.stamp = ++c.hdr->clock;
+    c.lru.splice(c.lru.begin(), c.lru, c.lru_pos[it->second]);
+    cmd_out.assign(r.cmd, r.cmd_len);
+    c.hits++;
+    return true;
+}
 
-            awaiting_confirm = false;
-            input_blocked.store(false);
-            return;
+static void ai_cache_store(const std::string &key, const std::string &cmd){
+    AiCache &c = ai_cache;
+    if(key.size() > sizeof(AiCacheRecord::key) || cmd.empty() || cmd.size() > sizeof(AiCacheRecord::cmd)) return;
+    std::lock_guard<std::mutex> g(c.mtx);
+    if(!c.hdr) return;
+    AiCacheFileLock lock(c);
+    uint64_t h = fnv1a64(key);
+    uint32_t slot = 0;
+    auto it = c.index.find(h);
+    if(it != c.index.end()){
+        slot = it->second;
+        c.lru.splice(c.lru.begin(), c.lru, c.lru_pos[slot]);
+    } else {
+        while(slot < AI_CACHE_CAPACITY && c.recs[slot].hash) ++slot;
+        if(slot == AI_CACHE_CAPACITY){
+            slot = c.lru.back(); // evict least recently used
+            c.index.erase(c.recs[slot].hash);
+            c.lru.pop_back();
         }
-
-        // Ignore all other keys during confirmation
-        return;
+        c.lru_pos[slot] = c.lru.insert(c.lru.begin(), slot);
+        c.index[h] = slot;
     }
+    AiCacheRecord &r = c.recs[slot];
+    r.hash = h;
+    r.stamp = ++c.hdr->clock;
+    r.key_len = (uint16_t)key.size(); memcpy(r.key, key.data(), key.size());
+    r.cmd_len = (uint16_t)cmd.size(); memcpy(r.cmd, cmd.data(), cmd.size());
+}
 
-    // ============================================================
-    // 2. Shift+Enter triggers AI
-    // ============================================================
-    if (key == GLFW_KEY_ENTER && (mods & GLFW_MOD_SHIFT))
-    {
-        std::string current_line = shell_buffer;
+// Forget a declined suggestion so the next identical request asks the model again.
+static void ai_cache_erase(const std::string &key){
+    AiCache &c = ai_cache;
+    std::lock_guard<std::mutex> g(c.mtx);
+    if(!c.hdr) return;
+    AiCacheFileLock lock(c);
+    auto it = c.index.find(fnv1a64(key));
+    if(it == c.index.end()) return;
+    uint32_t slot = it->second;
+    AiCacheRecord &r = c.recs[slot];
+    if(r.key_len != key.size() || memcmp(r.key, key.data(), key.size()) != 0) return;
+    c.lru.erase(c.lru_pos[slot]);
+    c.lru_pos[slot] = c.lru.end();
+    c.index.erase(it);
+    r.hash = 0;
+    ++c.hdr->clock; // other processes rebuild their index
+}
 
-        size_t p = current_line.find_first_not_of(' ');
-        if (p != std::string::npos)
-            current_line = current_line.substr(p);
+static std::vector<std::string> ai_metrics_dump_lines(){
+    std::vector<std::string> lines = ai_metrics_report();
+    uint64_t h = ai_cache.hits.load(), m = ai_cache.misses.load();
+    lines.push_back("  cache          " + std::to_string(h) + " hits, " + std::to_string(m) + " misses" +
+                    (h + m ? " (" + std::to_string(100 * h / (h + m)) + "% hit)" : std::string()));
+    lines.push_back("[PTY input] " + std::to_string(pty_metrics.sends) + " sends in " + std::to_string(pty_metrics.writes) +
+                    " writes, " + std::to_string(pty_metrics.bytes) + " bytes, tty full " + std::to_string(pty_metrics.full) +
+                    " times, max queued " + std::to_string(pty_metrics.max_queued) + " bytes, " +
+                    std::to_string(pty_metrics.flood_frames) + " flood frames, " +
+                    std::to_string(pty_metrics.held_frames) + " held frames");
+    char buf[160];
+    snprintf(buf, sizeof(buf), "  %-15s n=%-6llu p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f ms", "^C to drained",
+             (unsigned long long)interrupt_drain.n.load(), interrupt_drain.percentile(50) * 1e-3, interrupt_drain.percentile(90) * 1e-3,
+             interrupt_drain.percentile(99) * 1e-3, interrupt_drain.max.load() * 1e-3);
+    lines.push_back(buf);
+    return lines;
+}
 
-        if (current_line.empty())
-        {
-            std::string hint = "[AI] Nothing to send (empty line).";
-            for (char c : hint) process_byte_ansi(c);
-            process_byte_ansi('\n');
-            return;
-        }
+// ---------- Local history index ----------
+// BM25 over shell history and accepted AI request->command pairs. A confident
+// match is offered straight away; the model is only asked (or, with
+// CEREBRO_AI_REFINE=1, asked in addition) when nothing local fits.
+struct HistoryDoc {
+    std::string request;   // natural-language request, empty for plain shell history
+    std::string command;
+    uint32_t count = 1;    // times seen
+};
+struct HistoryPosting { uint32_t doc; uint16_t tf; };
+struct HistoryIndex {
+    std::mutex mtx;
+    std::vector<HistoryDoc> docs;
+    std::unordered_map<std::string, std::vector<HistoryPosting>> postings;
+    std::unordered_map<std::string, uint32_t> by_text; // request \0 command -> doc
+    std::vector<uint32_t> doc_len;  // tokens per doc, kept dense for the scoring loop
+    uint64_t total_len = 0;
+    std::vector<float> acc;        // lookup scratch, sized to docs
+    std::vector<uint32_t> touched;
+};
+static HistoryIndex history_index;
+static bool ai_refine = false;
 
-        input_blocked.store(true);
+static void history_tokenize(const std::string &s, std::vector<std::string> &out){
+    static const char* stop[] = {"a","an","the","all","in","of","to","for","me","my","and","or","with","on","is","are","this","that","please","how","do","i","what"};
+    std::string t;
+    auto flush = [&](){
+        if(t.size() > 3 && t.back() == 's' && t[t.size()-2] != 's') t.pop_back(); // files -> file
+        bool skip = t.empty();
+        for(const char* w : stop) if(!skip && t == w) skip = true;
+        if(!skip) out.push_back(t);
+        t.clear();
+    };
+    for(char c : s){
+        unsigned char u = (unsigned char)c;
+        if(std::isalnum(u) || u == '_') t.push_back((char)std::tolower(u));
+        else flush();
+    }
+    flush();
+}
 
-        {
-            std::lock_guard<std::mutex> lock(ai_mutex);
-            ai_ready = false;
-        }
+// caller holds mtx
+static void history_add_locked(HistoryIndex &h, const std::string &request, const std::string &command){
+    if(command.empty()) return;
+    std::string text_key = request + '\0' + command;
+    auto it = h.by_text.find(text_key);
+    if(it != h.by_text.end()){ h.docs[it->second].count++; return; }
 
-        run_llm_async(current_line);
+    uint32_t id = (uint32_t)h.docs.size();
+    std::vector<std::string> toks;
+    history_tokenize(request, toks);
+    history_tokenize(command, toks);
+    std::sort(toks.begin(), toks.end());
+    for(size_t i=0;i<toks.size();){
+        size_t j = i;
+        while(j < toks.size() && toks[j] == toks[i]) ++j;
+        h.postings[toks[i]].push_back(HistoryPosting{id, (uint16_t)std::min<size_t>(j - i, 65535)});
+        i = j;
+    }
+    HistoryDoc d;
+    d.request = request;
+    d.command = command;
+    h.docs.push_back(std::move(d));
+    h.doc_len.push_back((uint32_t)toks.size());
+    h.total_len += toks.size();
+    h.by_text.emplace(std::move(text_key), id);
+}
 
-        std::string msg = "[AI] Thinking...";
-        for (char c : msg) process_byte_ansi(c);
-        process_byte_ansi('\n');
+static std::string data_dir(){
+    std::string dir;
+    if(const char* x = getenv("XDG_DATA_HOME")) dir = x;
+    else if(const char* h = getenv("HOME")) dir = std::string(h) + "/.local/share";
+    if(dir.empty()) return "";
+    mkdir(dir.c_str(), 0755);
+    dir += "/cerebroshell";
+    mkdir(dir.c_str(), 0755);
+    return dir;
+}
 
-        return;
+static void history_load_file(HistoryIndex &h, const std::string &path){
+    FILE* f = fopen(path.c_str(), "r");
+    if(!f) return;
+    bool fish = path.find("fish_history") != std::string::npos;
+    char* line = nullptr; size_t cap = 0; ssize_t n;
+    while((n = getline(&line, &cap, f)) > 0){
+        std::string l(line, (size_t)n);
+        while(!l.empty() && (l.back()=='\n' || l.back()=='\r')) l.pop_back();
+        if(fish){
+            if(l.rfind("- cmd: ", 0) != 0) continue;
+            l = l.substr(7);
+        } else if(l.size() > 2 && l[0] == ':' && l[1] == ' '){ // zsh extended history
+            size_t semi = l.find(';');
+            if(semi == std::string::npos) continue;
+            l = l.substr(semi + 1);
+        } else if(!l.empty() && l[0] == '#') continue; // bash timestamps
+        size_t tab = l.find('\t');
+        if(tab != std::string::npos) history_add_locked(h, l.substr(0, tab), l.substr(tab + 1)); // accepted AI pairs
+        else history_add_locked(h, "", l);
     }
+    free(line);
+    fclose(f);
+}
 
-    // ============================================================
-    // 3. Regular Enter → send shell_buffer to PTY
-    // ============================================================
-    if (key == GLFW_KEY_ENTER)
-    {
-        if (!shell_buffer.empty())
-        {
-            send_key_to_pty(shell_buffer + "\n");
-            process_byte_ansi('\n');
-            shell_buffer.clear();
-            cursor_x = 0;
-        }
-        else
-        {
-            send_key_to_pty("\n");
-            process_byte_ansi('\n');
-        }
-        return;
+// Runs on a background thread at startup; never blocks the first frame.
+static void history_index_build(){
+    HistoryIndex local;
+    std::vector<std::string> files;
+    std::string home = getenv("HOME") ? getenv("HOME") : "";
+    if(const char* hf = getenv("HISTFILE")) files.push_back(hf);
+    if(!home.empty()){
+        files.push_back(home + "/.bash_history");
+        files.push_back(home + "/.zsh_history");
+        files.push_back(home + "/.local/share/fish/fish_history");
     }
+    std::string dd = data_dir();
+    if(!dd.empty()) files.push_back(dd + "/ai_history.tsv");
+    for(const std::string &f : files) history_load_file(local, f);
 
-    // ============================================================
-    // 4. Backspace
-    // ============================================================
-    if (key == GLFW_KEY_BACKSPACE)
-    {
-        shell_backspace();
-        return;
-    }
+    std::lock_guard<std::mutex> g(history_index.mtx);
+    // keep anything recorded while we were loading
+    for(const HistoryDoc &d : history_index.docs)
+        for(uint32_t i=0;i<d.count;++i) history_add_locked(local, d.request, d.command);
+    history_index.docs.swap(local.docs);
+    history_index.postings.swap(local.postings);
+    history_index.by_text.swap(local.by_text);
+    history_index.doc_len.swap(local.doc_len);
+    history_index.total_len = local.total_len;
+}
 
-    // ============================================================
-    // 5. Ctrl+C / Ctrl+D
-    // ============================================================
-    if (key == GLFW_KEY_C && (mods & GLFW_MOD_CONTROL))
+static void history_index_record(const std::string &request, const std::string &command){
     {
-        send_key_to_pty(std::string(1, 3)); // ^C
-        return;
+        std::lock_guard<std::mutex> g(history_index.mtx);
+        history_add_locked(history_index, request, command);
     }
-
-    if (key == GLFW_KEY_D && (mods & GLFW_MOD_CONTROL))
-    {
-        send_key_to_pty(std::string(1, 4)); // ^D
-        return;
+    if(request.empty()) return; // plain commands are in the shell's own history
+    std::string dd = data_dir();
+    if(dd.empty()) return;
+    if(FILE* f = fopen((dd + "/ai_history.tsv").c_str(), "a")){
+        std::string r = request, c = command;
+        std::replace(r.begin(), r.end(), '\t', ' ');
+        std::replace(c.begin(), c.end(), '\t', ' ');
+        fprintf(f, "%s\t%s\n", r.c_str(), c.c_str());
+        fclose(f);
     }
+}
 
-    // ============================================================
-    // 6. Tab
-    // ============================================================
-    if (key == GLFW_KEY_TAB)
-    {
-        append_to_shell_buffer('\t');
-        return;
-    }
+// Times `command` was run or accepted.
+static uint32_t history_index_count(const std::string &command){
+    std::lock_guard<std::mutex> g(history_index.mtx);
+    auto it = history_index.by_text.find(std::string(1, '\0') + command);
+    return it == history_index.by_text.end() ? 0 : history_index.docs[it->second].count;
+}
 
-    // ============================================================
-    // 7. Escape closes window
-    // ============================================================
-    if (key == GLFW_KEY_ESCAPE)
-    {
-        glfwSetWindowShouldClose(window, GL_TRUE);
-        return;
+// Best command for the request and its confidence in [0,1]: the idf-weighted
+// share of request terms found in the matching entry.
+static bool history_index_lookup(const std::string &request, std::string &cmd_out, float &confidence){
+    std::vector<std::string> q;
+    history_tokenize(request, q);
+    std::sort(q.begin(), q.end());
+    q.erase(std::unique(q.begin(), q.end()), q.end());
+    if(q.empty()) return false;
+
+    HistoryIndex &h = history_index;
+    std::lock_guard<std::mutex> g(h.mtx);
+    if(h.docs.empty()) return false;
+    const float k1 = 1.2f, b = 0.75f;
+    float N = (float)h.docs.size();
+    float avglen = h.total_len ? (float)h.total_len / N : 1.0f;
+    if(h.acc.size() < h.docs.size()) h.acc.resize(h.docs.size(), 0.0f);
+
+    std::vector<float> idf(q.size());
+    std::vector<const std::vector<HistoryPosting>*> lists(q.size(), nullptr);
+    float idf_total = 0;
+    for(size_t i=0;i<q.size();++i){
+        auto it = h.postings.find(q[i]);
+        float df = it == h.postings.end() ? 0.0f : (float)it->second.size();
+        idf[i] = std::log(1.0f + (N - df + 0.5f) / (df + 0.5f));
+        idf_total += idf[i];
+        if(it != h.postings.end()) lists[i] = &it->second;
+    }
+    for(size_t i=0;i<q.size();++i){
+        if(!lists[i]) continue;
+        for(const HistoryPosting &p : *lists[i]){
+            float tf = p.tf;
+            if(h.acc[p.doc] == 0.0f) h.touched.push_back(p.doc);
+            h.acc[p.doc] += idf[i] * tf * (k1 + 1) / (tf + k1 * (1 - b + b * h.doc_len[p.doc] / avglen));
+        }
+    }
+    uint32_t best = 0; float best_score = 0;
+    for(uint32_t d : h.touched){
+        // prefer accepted AI pairs and frequently used commands
+        float s = h.acc[d];
+        if(s * 1.5f > best_score){
+            const HistoryDoc &doc = h.docs[d];
+            if(doc.count > 1) s *= std::min(1.25f, 1.0f + 0.1f * std::log((float)doc.count));
+            if(!doc.request.empty()) s *= 1.2f;
+        }
+        if(s > best_score){ best_score = s; best = d; }
     }
+    for(uint32_t d : h.touched) h.acc[d] = 0.0f;
+    h.touched.clear();
+    if(best_score <= 0) return false;
+
+    std::vector<std::string> dt;
+    history_tokenize(h.docs[best].request, dt);
+    history_tokenize(h.docs[best].command, dt);
+    std::sort(dt.begin(), dt.end());
+    float covered = 0;
+    for(size_t i=0;i<q.size();++i) if(std::binary_search(dt.begin(), dt.end(), q[i])) covered += idf[i];
+    confidence = idf_total > 0 ? covered / idf_total : 0.0f;
+    cmd_out = h.docs[best].command;
+    return true;
 }
 
-// ---------- Main ----------
-int main(int argc, char** argv){
-    const char* fontpath = "/usr/share/fonts/TTF/HackNerdFontMono-Regular.ttf";
-    if(argc > 1) fontpath = argv[1];
+// ---------- Local documentation index (man pages, --help) ----------
+// Paragraph snippets from man pages (sections 1 and 8) and from the --help of
+// commands in the shell history that have no man page, in an mmap-able
+// inverted index (~/.cache/cerebroshell/doc_index.bin). Built on a background
+// thread; sources whose mtime is unchanged are copied from the previous index
+// instead of being parsed again. The best few snippets for a request are added
+// to the user prompt so a small model gets the flags right.
+struct DocIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_sources, n_snippets, n_terms;
+    uint64_t total_tokens;
+    uint64_t sources_off, snippets_off, terms_off, postings_off, blob_off;
+    uint64_t file_len;
+};
+struct DocSource  { uint64_t mtime_ns; uint32_t path_off, path_len; uint32_t first_snippet, n_snippets; };
+struct DocSnippet { uint32_t text_off; uint16_t text_len; uint16_t n_tokens; };
+struct DocTerm    { uint64_t hash; uint32_t post_off, post_len; }; // sorted by hash
+// postings: uint32_t snippet << 4 | min(tf, 15)
+static_assert(sizeof(DocIndexHeader) == 80, "doc index header layout");
+static_assert(sizeof(DocSource) == 24 && sizeof(DocSnippet) == 8 && sizeof(DocTerm) == 16, "doc index record layout");
 
-    // initial guesses
-    CHAR_W = 10; CHAR_H = 18;
-    int win_w = WINDOW_W, win_h = WINDOW_H;
-    COLS = win_w / CHAR_W; ROWS = win_h / CHAR_H;
-    if(COLS < 10) COLS = 80;
-    if(ROWS < 5) ROWS = 24;
+struct DocMap {
+    void* mem = nullptr;
+    size_t len = 0;
+    const DocIndexHeader* hdr = nullptr;
+    const DocSource* sources = nullptr;
+    const DocSnippet* snippets = nullptr;
+    const DocTerm* terms = nullptr;
+    const uint32_t* postings = nullptr;
+    const char* blob = nullptr;
+    ~DocMap(){ if(mem) munmap(mem, len); }
+};
+static std::mutex doc_index_mtx;
+static std::shared_ptr<DocMap> doc_index;      // swapped whole after a rebuild
+static std::atomic<bool> doc_index_running(false);
+static double doc_index_built_at = 0;
+static bool ai_docs = true;                     // CEREBRO_AI_DOCS=0 disables retrieval
+static bool ai_docs_help = false;               // CEREBRO_AI_DOCS_HELP=1 also runs `cmd --help` for history commands
 
-    termBuf.resize(ROWS, std::string(COLS, ' '));
-    termColor.resize(ROWS, std::vector<Color>(COLS, Color{1,1,1}));
+static std::shared_ptr<DocMap> doc_index_map(const std::string &path){
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return nullptr;
+    struct stat st;
+    void* mem = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(DocIndexHeader))
+        mem = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED) return nullptr;
+    auto m = std::make_shared<DocMap>();
+    m->mem = mem; m->len = (size_t)st.st_size;
+    const DocIndexHeader* h = (const DocIndexHeader*)mem;
+    auto fits = [&](uint64_t off, uint64_t n, size_t sz){ return off <= m->len && n <= (m->len - off) / sz; };
+    if(memcmp(h->magic, "CRBDOC01", 8) != 0 || h->version != 1 || h->file_len != m->len ||
+       !fits(h->sources_off, h->n_sources, sizeof(DocSource)) || !fits(h->snippets_off, h->n_snippets, sizeof(DocSnippet)) ||
+       !fits(h->terms_off, h->n_terms, sizeof(DocTerm)) || h->postings_off > h->blob_off || h->blob_off > m->len) return nullptr;
+    m->hdr = h;
+    m->sources = (const DocSource*)((const char*)mem + h->sources_off);
+    m->snippets = (const DocSnippet*)((const char*)mem + h->snippets_off);
+    m->terms = (const DocTerm*)((const char*)mem + h->terms_off);
+    m->postings = (const uint32_t*)((const char*)mem + h->postings_off);
+    m->blob = (const char*)mem + h->blob_off;
 
-    // spawn PTY + shell
-    pid_t pid = forkpty(&master_fd, NULL, NULL, NULL);
-    if(pid < 0){ perror("forkpty"); return 1; }
-    if(pid == 0){
+    // the file lives in a user-writable dir and may come from another version:
+    // every reference must stay inside its section, or the whole index is unused
+    uint64_t n_postings = (h->blob_off - h->postings_off) / sizeof(uint32_t);
+    uint64_t blob_len = m->len - h->blob_off;
+    for(uint32_t i = 0; i < h->n_sources; ++i){
+        const DocSource &src = m->sources[i];
+        if((uint64_t)src.path_off + src.path_len > blob_len || (uint64_t)src.first_snippet + src.n_snippets > h->n_snippets) return nullptr;
+    }
+    for(uint32_t i = 0; i < h->n_snippets; ++i)
+        if((uint64_t)m->snippets[i].text_off + m->snippets[i].text_len > blob_len) return nullptr;
+    for(uint32_t i = 0; i < h->n_terms; ++i)
+        if((uint64_t)m->terms[i].post_off + m->terms[i].post_len > n_postings) return nullptr;
+    for(uint64_t i = 0; i < n_postings; ++i)
+        if((m->postings[i] >> 4) >= h->n_snippets) return nullptr;
+    return m;
+}
+
+static void doc_index_open(){
+    std::string dir = cache_dir();
+    if(dir.empty()) return;
+    std::shared_ptr<DocMap> m = doc_index_map(dir + "/doc_index.bin");
+    std::lock_guard<std::mutex> g(doc_index_mtx);
+    if(m) doc_index = m;
+}
+
+// Full path of prog on PATH, or "".
+static std::string path_lookup(const std::string &prog){
+    if(prog.find('/') != std::string::npos) return access(prog.c_str(), X_OK) == 0 ? prog : "";
+    const char* path = getenv("PATH");
+    std::string p = path ? path : "/usr/local/bin:/usr/bin:/bin";
+    size_t a = 0;
+    for(;;){
+        size_t b = p.find(':', a);
+        std::string dir = p.substr(a, b == std::string::npos ? std::string::npos : b - a);
+        if(dir.empty()) dir = ".";
+        std::string full = dir + "/" + prog;
+        if(access(full.c_str(), X_OK) == 0) return full;
+        if(b == std::string::npos) return "";
+        a = b + 1;
+    }
+}
+
+// roff escapes -> plain text (font changes, special characters, strings dropped)
+static void doc_roff_text(const std::string &in, std::string &out){
+    for(size_t i = 0; i < in.size(); ++i){
+        char c = in[i];
+        if(c != '\\'){ out.push_back(c); continue; }
+        if(++i >= in.size()) break;
+        char e = in[i];
+        auto skip_name = [&](){ // (xx, [name] or a single character
+            if(i + 1 >= in.size()) return std::string();
+            if(in[i+1] == '('){ std::string n = in.substr(i + 2, 2); i += 3; return n; }
+            if(in[i+1] == '['){ size_t end = in.find(']', i + 2); std::string n = in.substr(i + 2, end == std::string::npos ? std::string::npos : end - i - 2); i = end == std::string::npos ? in.size() : end; return n; }
+            return std::string(1, in[++i]);
+        };
+        switch(e){
+            case '"': return;                                   // comment
+            case 'f': case '*': case 'n': case 'm': skip_name(); break;
+            case '(': case '[': {
+                --i;
+                std::string n = skip_name();
+                if(n == "em" || n == "en" || n == "hy" || n == "mi") out.push_back('-');
+                else if(n == "aq" || n == "cq" || n == "oq") out.push_back('\'');
+                else if(n == "dq" || n == "lq" || n == "rq") out.push_back('"');
+                else if(n == "bu") out.push_back('*');
+                break;
+            }
+            case 's':
+                if(i + 1 < in.size() && (in[i+1] == '+' || in[i+1] == '-')) ++i;
+                while(i + 1 < in.size() && std::isdigit((unsigned char)in[i+1])) ++i;
+                break;
+            case 'e': out.push_back('\\'); break;
+            case '-': out.push_back('-'); break;
+            case ' ': case '~': out.push_back(' '); break;
+            case '&': case '|': case '^': case 'c': case ',': case '/': case ':': break;
+            default: out.push_back(e);
+        }
+    }
+}
+
+// Man page source -> paragraphs of plain text. Empty if it is only a .so link.
+static void doc_roff_paragraphs(const std::string &src, std::vector<std::string> &paras){
+    static const char* skipped[] = {"SEE ALSO", "AUTHOR", "AUTHORS", "COPYRIGHT", "REPORTING BUGS", "HISTORY", "BUGS", "COLOPHON", "STANDARDS", "CONFORMING TO"};
+    std::string cur;
+    bool skip = false;
+    auto flush = [&](){
+        if(!skip && cur.find_first_not_of(' ') != std::string::npos) paras.push_back(cur);
+        cur.clear();
+    };
+    auto args_text = [](const std::string &args, bool joined, const char* prefix){
+        std::string out, word;
+        bool q = false;
+        for(size_t i = 0; i <= args.size(); ++i){
+            char c = i < args.size() ? args[i] : ' ';
+            if(c == '"'){ q = !q; continue; }
+            if(c == ' ' && !q){
+                if(!word.empty()){ if(!out.empty() && !joined) out.push_back(' '); out += prefix + word; word.clear(); }
+                continue;
+            }
+            word.push_back(c);
+        }
+        return out;
+    };
+    size_t a = 0;
+    while(a < src.size()){
+        size_t b = src.find('\n', a);
+        if(b == std::string::npos) b = src.size();
+        std::string line = src.substr(a, b - a);
+        a = b + 1;
+        if(line.empty()){ flush(); continue; }
+        if(line[0] != '.' && line[0] != '\''){
+            if(!cur.empty()) cur.push_back(' ');
+            doc_roff_text(line, cur);
+            continue;
+        }
+        size_t m = line.find_first_not_of(" \t", 1);
+        if(m == std::string::npos) continue;
+        size_t me = line.find_first_of(" \t", m);
+        std::string mac = line.substr(m, me == std::string::npos ? std::string::npos : me - m);
+        std::string args = me == std::string::npos ? "" : line.substr(line.find_first_not_of(" \t", me) == std::string::npos ? line.size() : line.find_first_not_of(" \t", me));
+        std::string text;
+        doc_roff_text(args, text);
+        if(mac == "so"){ paras.clear(); return; }
+        if(mac == "SH" || mac == "SS" || mac == "Sh" || mac == "Ss"){
+            flush();
+            std::string sec = args_text(text, false, "");
+            std::transform(sec.begin(), sec.end(), sec.begin(), [](unsigned char c){ return (char)std::toupper(c); });
+            if(mac == "SH" || mac == "Sh"){
+                skip = false;
+                for(const char* s : skipped) if(sec == s) skip = true;
+            }
+        } else if(mac == "TP" || mac == "PP" || mac == "LP" || mac == "P" || mac == "HP" || mac == "Pp" || mac == "It" || mac == "IP"){
+            flush();
+            if(mac == "It" || mac == "IP") cur = args_text(text, false, "");
+        } else if(mac == "B" || mac == "I" || mac == "SM" || mac == "SB" || mac == "Nm" || mac == "Ar" || mac == "Cm" || mac == "Pa" ||
+                  mac == "Op" || mac == "Dl" || mac == "Ev" || mac == "Xr" || mac == "Em" || mac == "Sy" || mac == "Li" || mac == "Ql"){
+            if(!cur.empty()) cur.push_back(' ');
+            cur += args_text(text, false, "");
+        } else if(mac == "BR" || mac == "RB" || mac == "IR" || mac == "RI" || mac == "BI" || mac == "IB"){
+            if(!cur.empty()) cur.push_back(' ');
+            cur += args_text(text, true, "");
+        } else if(mac == "Fl"){
+            if(!cur.empty()) cur.push_back(' ');
+            cur += args_text(text, false, "-");
+        } else if(mac == "Nd"){
+            cur += " - " + args_text(text, false, "");
+        } else if(mac == "br" || mac == "sp"){
+            if(!cur.empty()) cur.push_back(' ');
+        }
+        // everything else (.TH, .nf, .RS, .de, ...) carries no prose
+    }
+    flush();
+}
+
+static void doc_help_paragraphs(const std::string &text, std::vector<std::string> &paras){
+    std::string cur;
+    size_t a = 0;
+    while(a < text.size()){
+        size_t b = text.find('\n', a);
+        if(b == std::string::npos) b = text.size();
+        std::string line = text.substr(a, b - a);
+        a = b + 1;
+        size_t ind = line.find_first_not_of(" \t");
+        bool starts = ind == std::string::npos || line[ind] == '-' || ind == 0;
+        if(starts && cur.find_first_not_of(' ') != std::string::npos){ paras.push_back(cur); cur.clear(); }
+        if(ind == std::string::npos) continue;
+        if(!cur.empty()) cur.push_back(' ');
+        cur += line.substr(ind);
+    }
+    if(cur.find_first_not_of(' ') != std::string::npos) paras.push_back(cur);
+}
+
+static bool doc_read_file(const std::string &path, std::string &out){
+    out.clear();
+    if(path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0){
+        gzFile z = gzopen(path.c_str(), "rb");
+        if(!z) return false;
+        char buf[16384];
+        int n;
+        while((n = gzread(z, buf, sizeof(buf))) > 0 && out.size() < (4u << 20)) out.append(buf, (size_t)n);
+        gzclose(z);
+        return n >= 0;
+    }
+    FILE* f = fopen(path.c_str(), "rb");
+    if(!f) return false;
+    char buf[16384];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0 && out.size() < (4u << 20)) out.append(buf, n);
+    fclose(f);
+    return true;
+}
+
+// `prog --help` (stdout and stderr) with a short timeout, or "" on failure.
+// Runs on the indexing thread, so everything the child needs is prepared before
+// fork(); the child only makes async-signal-safe calls.
+static std::string doc_run_help(const std::string &prog){
+    std::vector<std::string> env;
+    for(char** e = environ; *e; ++e)
+        if(strncmp(*e, "LC_ALL=", 7) != 0 && strncmp(*e, "PAGER=", 6) != 0) env.push_back(*e);
+    env.push_back("LC_ALL=C");
+    env.push_back("PAGER=cat");
+    std::vector<char*> envp;
+    for(std::string &e : env) envp.push_back(&e[0]);
+    envp.push_back(nullptr);
+    char help_arg[] = "--help";
+    char* argv[] = {const_cast<char*>(prog.c_str()), help_arg, nullptr};
+
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int pfd[2];
+    if(pipe2(pfd, O_CLOEXEC) != 0){ if(devnull >= 0) close(devnull); return ""; }
+    pid_t pid = fork();
+    if(pid < 0){ close(pfd[0]); close(pfd[1]); if(devnull >= 0) close(devnull); return ""; }
+    if(pid == 0){
+        setpgid(0, 0);
+        if(devnull >= 0) dup2(devnull, STDIN_FILENO);
+        dup2(pfd[1], STDOUT_FILENO);
+        dup2(pfd[1], STDERR_FILENO);
+        if(chdir("/") != 0) _exit(127);
+        execve(argv[0], argv, envp.data());
+        _exit(127);
+    }
+    setpgid(pid, pid); // also here, so kill(-pid) below cannot race the child's own call
+    close(pfd[1]);
+    if(devnull >= 0) close(devnull);
+    std::string out;
+    char buf[4096];
+    double deadline = now_sec() + 1.0;
+    for(;;){
+        double left = deadline - now_sec();
+        if(left <= 0){ kill(-pid, SIGKILL); break; }
+        fd_set rf; FD_ZERO(&rf); FD_SET(pfd[0], &rf);
+        timeval tv = {0, (suseconds_t)(std::min(left, 0.1) * 1e6)};
+        int r = select(pfd[0]+1, &rf, NULL, NULL, &tv);
+        if(r < 0 && errno != EINTR) break;
+        if(r <= 0) continue;
+        ssize_t n = read(pfd[0], buf, sizeof(buf));
+        if(n <= 0) break;
+        out.append(buf, (size_t)n);
+        if(out.size() > 65536){ kill(-pid, SIGKILL); break; }
+    }
+    close(pfd[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return out;
+}
+
+struct DocSourceBuild {
+    std::string path;
+    uint64_t mtime_ns = 0;
+    std::vector<std::string> snippets;
+};
+
+// Paragraphs -> "name: text" snippets of at most DOC_SNIPPET_BYTES.
+static void doc_add_snippets(DocSourceBuild &s, const std::string &name, const std::vector<std::string> &paras){
+    for(const std::string &p : paras){
+        if(s.snippets.size() >= DOC_MAX_SNIPPETS_PER_PAGE) break;
+        std::string t = name + ": ";
+        for(char c : p){
+            if(c == '\t' || c == '\r' || c == '\n') c = ' ';
+            if(c == ' ' && t.back() == ' ') continue;
+            t.push_back(c);
+        }
+        while(!t.empty() && t.back() == ' ') t.pop_back();
+        if(t.size() < name.size() + 14) continue;
+        if(t.size() > DOC_SNIPPET_BYTES){
+            size_t cut = t.rfind(' ', DOC_SNIPPET_BYTES);
+            t.resize(cut == std::string::npos || cut < DOC_SNIPPET_BYTES / 2 ? DOC_SNIPPET_BYTES : cut);
+        }
+        s.snippets.push_back(t);
+    }
+}
+
+static uint64_t mtime_ns(const struct stat &st){
+    return (uint64_t)st.st_mtim.tv_sec * 1000000000ull + (uint64_t)st.st_mtim.tv_nsec;
+}
+
+static void doc_index_write(const std::string &path, const std::vector<DocSourceBuild> &srcs){
+    std::vector<DocSource> sources;
+    std::vector<DocSnippet> snippets;
+    std::string blob;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> post;
+    uint64_t total_tokens = 0;
+    std::vector<std::string> toks;
+    for(const DocSourceBuild &s : srcs){
+        DocSource ds{s.mtime_ns, (uint32_t)blob.size(), (uint32_t)s.path.size(), (uint32_t)snippets.size(), (uint32_t)s.snippets.size()};
+        blob += s.path;
+        sources.push_back(ds);
+        for(const std::string &t : s.snippets){
+            uint32_t id = (uint32_t)snippets.size();
+            toks.clear();
+            history_tokenize(t, toks);
+            std::sort(toks.begin(), toks.end());
+            for(size_t i = 0; i < toks.size();){
+                size_t j = i;
+                while(j < toks.size() && toks[j] == toks[i]) ++j;
+                post[fnv1a64(toks[i])].push_back(id << 4 | (uint32_t)std::min<size_t>(j - i, 15));
+                i = j;
+            }
+            snippets.push_back(DocSnippet{(uint32_t)blob.size(), (uint16_t)t.size(), (uint16_t)std::min<size_t>(toks.size(), 65535)});
+            blob += t;
+            total_tokens += toks.size();
+        }
+    }
+    std::vector<DocTerm> terms;
+    terms.reserve(post.size());
+    for(auto &p : post) terms.push_back(DocTerm{p.first, 0, (uint32_t)p.second.size()});
+    std::sort(terms.begin(), terms.end(), [](const DocTerm &a, const DocTerm &b){ return a.hash < b.hash; });
+    std::vector<uint32_t> postings;
+    for(DocTerm &t : terms){
+        std::vector<uint32_t> &v = post[t.hash];
+        t.post_off = (uint32_t)postings.size();
+        postings.insert(postings.end(), v.begin(), v.end());
+    }
+
+    DocIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "CRBDOC01", 8);
+    h.version = 1;
+    h.n_sources = (uint32_t)sources.size();
+    h.n_snippets = (uint32_t)snippets.size();
+    h.n_terms = (uint32_t)terms.size();
+    h.total_tokens = total_tokens;
+    h.sources_off = sizeof(h);
+    h.snippets_off = h.sources_off + sources.size() * sizeof(DocSource);
+    h.terms_off = h.snippets_off + snippets.size() * sizeof(DocSnippet);
+    h.postings_off = h.terms_off + terms.size() * sizeof(DocTerm);
+    h.blob_off = h.postings_off + postings.size() * sizeof(uint32_t);
+    h.file_len = h.blob_off + blob.size();
+
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if(!f) return;
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && (sources.empty() || fwrite(sources.data(), sizeof(DocSource), sources.size(), f) == sources.size());
+    ok = ok && (snippets.empty() || fwrite(snippets.data(), sizeof(DocSnippet), snippets.size(), f) == snippets.size());
+    ok = ok && (terms.empty() || fwrite(terms.data(), sizeof(DocTerm), terms.size(), f) == terms.size());
+    ok = ok && (postings.empty() || fwrite(postings.data(), sizeof(uint32_t), postings.size(), f) == postings.size());
+    ok = ok && (blob.empty() || fwrite(blob.data(), 1, blob.size(), f) == blob.size());
+    ok = (fclose(f) == 0) && ok;
+    if(!ok || rename(tmp.c_str(), path.c_str()) != 0) unlink(tmp.c_str());
+}
+
+// Background (re)build; unchanged sources are copied from the current index.
+static void doc_index_build(){
+    if(doc_index_running.exchange(true)) return;
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+    std::string dir = cache_dir();
+    std::shared_ptr<DocMap> old;
+    { std::lock_guard<std::mutex> g(doc_index_mtx); old = doc_index; }
+    std::unordered_map<std::string, uint32_t> old_by_path;
+    if(old) for(uint32_t i = 0; i < old->hdr->n_sources; ++i)
+        old_by_path.emplace(std::string(old->blob + old->sources[i].path_off, old->sources[i].path_len), i);
+
+    std::vector<DocSourceBuild> srcs;
+    std::unordered_set<std::string> names;   // commands with a man page
+    auto add = [&](const std::string &path, const struct stat &st, const std::string &name, bool help){
+        DocSourceBuild s;
+        s.path = path;
+        s.mtime_ns = mtime_ns(st);
+        auto it = old_by_path.find(path);
+        if(it != old_by_path.end() && old->sources[it->second].mtime_ns == s.mtime_ns){
+            const DocSource &o = old->sources[it->second];
+            for(uint32_t k = 0; k < o.n_snippets; ++k){
+                const DocSnippet &sn = old->snippets[o.first_snippet + k];
+                s.snippets.emplace_back(old->blob + sn.text_off, sn.text_len);
+            }
+        } else {
+            std::string text;
+            std::vector<std::string> paras;
+            if(help) doc_help_paragraphs(doc_run_help(path), paras);
+            else if(doc_read_file(path, text)) doc_roff_paragraphs(text, paras);
+            doc_add_snippets(s, name, paras);
+        }
+        srcs.push_back(std::move(s)); // kept even when empty so it is not parsed again
+    };
+
+    std::vector<std::string> roots;
+    std::string mp = getenv("MANPATH") ? getenv("MANPATH") : "";
+    for(size_t a = 0; a <= mp.size();){
+        size_t b = mp.find(':', a);
+        if(b == std::string::npos) b = mp.size();
+        if(b > a) roots.push_back(mp.substr(a, b - a));
+        a = b + 1;
+    }
+    if(roots.empty()) roots = {"/usr/share/man", "/usr/local/share/man"};
+    for(const std::string &root : roots){
+        for(const char* sec : {"man1", "man8"}){
+            std::string d = root + "/" + sec;
+            DIR* dp = opendir(d.c_str());
+            if(!dp) continue;
+            while(dirent* e = readdir(dp)){
+                std::string file = e->d_name;
+                if(file[0] == '.') continue;
+                std::string name = file;
+                if(name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0) name.resize(name.size() - 3);
+                else if(name.find(".bz2") != std::string::npos || name.find(".xz") != std::string::npos || name.find(".zst") != std::string::npos) continue;
+                size_t dot = name.rfind('.');
+                if(dot == std::string::npos || dot == 0) continue;
+                name.resize(dot);
+                std::string path = d + "/" + file;
+                struct stat st;
+                if(stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+                if(!names.insert(name).second) continue; // first MANPATH entry wins
+                add(path, st, name, false);
+            }
+            closedir(dp);
+        }
+    }
+
+    // --help for commands the user actually runs that have no man page (opt-in:
+    // it executes programs from the history)
+    static const char* never[] = {"rm", "dd", "mkfs", "shutdown", "reboot", "halt", "poweroff", "kill", "killall", "sudo", "su", "doas", "init", "telinit"};
+    std::vector<std::string> used;
+    if(ai_docs_help){
+        std::lock_guard<std::mutex> g(history_index.mtx);
+        std::unordered_set<std::string> uniq;
+        for(const HistoryDoc &d : history_index.docs){
+            std::stringstream ss(d.command); std::string w;
+            while(ss >> w && w.find('=') != std::string::npos){}
+            if(!w.empty() && std::all_of(w.begin(), w.end(), [](char c){ return std::isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.'; }) &&
+               uniq.insert(w).second) used.push_back(w);
+        }
+    }
+    size_t helps = 0;
+    for(const std::string &w : used){
+        if(helps >= DOC_MAX_HELP_COMMANDS) break;
+        if(names.count(w)) continue;
+        bool deny = false;
+        for(const char* n : never) if(w == n) deny = true;
+        std::string path = deny ? "" : path_lookup(w);
+        struct stat st;
+        if(path.empty() || stat(path.c_str(), &st) != 0) continue;
+        names.insert(w);
+        add(path, st, w, true);
+        helps++;
+    }
+
+    if(!dir.empty()){
+        doc_index_write(dir + "/doc_index.bin", srcs);
+        std::shared_ptr<DocMap> m = doc_index_map(dir + "/doc_index.bin");
+        std::lock_guard<std::mutex> g(doc_index_mtx);
+        if(m) doc_index = m;
+    }
+    doc_index_running.store(false);
+}
+
+// Rebuild in the background once an hour; cheap when nothing changed.
+static void doc_index_tick(double now){
+    if(!ai_docs || doc_index_running.load() || now - doc_index_built_at < DOC_INDEX_REFRESH) return;
+    doc_index_built_at = now;
+    std::thread(doc_index_build).detach();
+}
+
+// BM25 over snippets; the best k whose score is within half of the top one.
+static std::vector<std::string> doc_index_lookup(const std::string &request, size_t k = DOC_TOP_K){
+    std::vector<std::string> out;
+    if(!ai_docs) return out;
+    std::shared_ptr<DocMap> m;
+    { std::lock_guard<std::mutex> g(doc_index_mtx); m = doc_index; }
+    if(!m || m->hdr->n_snippets == 0) return out;
+    double t0 = now_sec();
+    std::vector<std::string> q;
+    history_tokenize(request, q);
+    std::sort(q.begin(), q.end());
+    q.erase(std::unique(q.begin(), q.end()), q.end());
+
+    thread_local std::vector<float> acc;
+    thread_local std::vector<uint32_t> touched;
+    const DocIndexHeader &h = *m->hdr;
+    if(acc.size() < h.n_snippets) acc.assign(h.n_snippets, 0.0f);
+    const float k1 = 1.2f, b = 0.75f;
+    float N = (float)h.n_snippets;
+    float avglen = h.total_tokens ? (float)h.total_tokens / N : 1.0f;
+    for(const std::string &t : q){
+        uint64_t hash = fnv1a64(t);
+        const DocTerm* end = m->terms + h.n_terms;
+        const DocTerm* it = std::lower_bound(m->terms, end, hash, [](const DocTerm &a, uint64_t v){ return a.hash < v; });
+        if(it == end || it->hash != hash) continue;
+        float df = (float)it->post_len;
+        float idf = std::log(1.0f + (N - df + 0.5f) / (df + 0.5f));
+        for(uint32_t i = 0; i < it->post_len; ++i){
+            uint32_t p = m->postings[it->post_off + i];
+            uint32_t id = p >> 4;
+            float tf = (float)(p & 15);
+            if(acc[id] == 0.0f) touched.push_back(id);
+            acc[id] += idf * tf * (k1 + 1) / (tf + k1 * (1 - b + b * m->snippets[id].n_tokens / avglen));
+        }
+    }
+    size_t n = std::min(k, touched.size());
+    std::partial_sort(touched.begin(), touched.begin() + (long)n, touched.end(), [&](uint32_t a, uint32_t c){ return acc[a] > acc[c]; });
+    for(size_t i = 0; i < n; ++i){
+        if(acc[touched[i]] < acc[touched[0]] * 0.5f) break;
+        const DocSnippet &s = m->snippets[touched[i]];
+        out.emplace_back(m->blob + s.text_off, s.text_len);
+    }
+    for(uint32_t id : touched) acc[id] = 0.0f;
+    touched.clear();
+    record_us(ai_metrics.doc_lookup, now_sec() - t0);
+    return out;
+}
+
+// ---------- AI prompt ----------
+// The instructions are a fixed prefix sent as the `system` field, so the rendered
+// prompt is byte-identical up to the user turn. With the model kept resident
+// (keep_alive) ollama reuses the KV cache for that prefix and only evaluates the
+// request itself.
+static const char* AI_SYSTEM_PROMPT =
+    "You are a shell assistant. Produce a single valid bash command that matches the user's request. "
+    "Reply with JSON only: {\"command\": \"<the command>\"}.";
+
+// Replies are constrained to that shape, so decoding ends when the object closes:
+// a JSON schema via ollama's `format`, the equivalent GBNF grammar in-process
+// (AI_REPLY_GBNF).
+static const char* AI_REPLY_SCHEMA =
+    "{\"type\":\"object\",\"properties\":{\"command\":{\"type\":\"string\"}},\"required\":[\"command\"]}";
+
+static std::string ai_user_prompt(const std::string &input_line, const std::vector<std::string> &docs = {}){
+    std::string p;
+    if(!docs.empty()){
+        p = "Relevant documentation:\n";
+        for(const std::string &d : docs) p += "- " + d + "\n";
+        p += "\n";
+    }
+    return p + "User request: " + input_line + "\nCommand:";
+}
+
+// ---------- Minimal JSON helpers (ollama API) ----------
+static std::string json_escape(const std::string &s){
+    std::string out;
+    out.reserve(s.size() + 8);
+    for(char c : s){
+        unsigned char u = (unsigned char)c;
+        switch(c){
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if(u < 0x20){ char b[8]; snprintf(b, sizeof(b), "\\u%04x", u); out += b; }
+                else out.push_back(c);
+        }
+    }
+    return out;
+}
+
+static void utf8_append(std::string &out, uint32_t cp){
+    if(cp < 0x80) out.push_back((char)cp);
+    else if(cp < 0x800){ out.push_back((char)(0xC0 | (cp >> 6))); out.push_back((char)(0x80 | (cp & 0x3F))); }
+    else if(cp < 0x10000){ out.push_back((char)(0xE0 | (cp >> 12))); out.push_back((char)(0x80 | ((cp >> 6) & 0x3F))); out.push_back((char)(0x80 | (cp & 0x3F))); }
+    else { out.push_back((char)(0xF0 | (cp >> 18))); out.push_back((char)(0x80 | ((cp >> 12) & 0x3F))); out.push_back((char)(0x80 | ((cp >> 6) & 0x3F))); out.push_back((char)(0x80 | (cp & 0x3F))); }
+}
+
+// Position just after `"key":` (and whitespace) in a flat JSON object, or npos.
+static size_t json_find_value(const std::string &obj, const char* key){
+    std::string pat = std::string("\"") + key + "\"";
+    size_t p = 0;
+    while((p = obj.find(pat, p)) != std::string::npos){
+        size_t q = p + pat.size();
+        while(q < obj.size() && std::isspace((unsigned char)obj[q])) ++q;
+        if(q < obj.size() && obj[q] == ':'){
+            ++q;
+            while(q < obj.size() && std::isspace((unsigned char)obj[q])) ++q;
+            return q;
+        }
+        p = q;
+    }
+    return std::string::npos;
+}
+
+static bool json_get_string(const std::string &obj, const char* key, std::string &out){
+    size_t p = json_find_value(obj, key);
+    if(p == std::string::npos || obj[p] != '"') return false;
+    out.clear();
+    for(++p; p < obj.size() && obj[p] != '"'; ++p){
+        char c = obj[p];
+        if(c != '\\'){ out.push_back(c); continue; }
+        if(++p >= obj.size()) break;
+        switch(obj[p]){
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'u': {
+                if(p + 4 >= obj.size()) return false;
+                uint32_t cp = (uint32_t)strtoul(obj.substr(p + 1, 4).c_str(), nullptr, 16);
+                p += 4;
+                if(cp >= 0xD800 && cp < 0xDC00 && p + 6 < obj.size() && obj[p+1] == '\\' && obj[p+2] == 'u'){
+                    uint32_t lo = (uint32_t)strtoul(obj.substr(p + 3, 4).c_str(), nullptr, 16);
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    p += 6;
+                }
+                utf8_append(out, cp);
+                break;
+            }
+            default: out.push_back(obj[p]);
+        }
+    }
+    return true;
+}
+
+static bool json_get_number(const std::string &obj, const char* key, double &out){
+    size_t p = json_find_value(obj, key);
+    if(p == std::string::npos) return false;
+    char* end = nullptr;
+    out = strtod(obj.c_str() + p, &end);
+    return end != obj.c_str() + p;
+}
+
+// Sum of every numeric `"key":` value in obj (e.g. per-token logprobs). Returns the count.
+static int json_sum_numbers(const std::string &obj, const char* key, double &sum){
+    std::string pat = std::string("\"") + key + "\":";
+    int n = 0;
+    for(size_t p = obj.find(pat); p != std::string::npos; p = obj.find(pat, p + 1)){
+        char* end = nullptr;
+        double v = strtod(obj.c_str() + p + pat.size(), &end);
+        if(end != obj.c_str() + p + pat.size()){ sum += v; ++n; }
+    }
+    return n;
+}
+
+static bool json_get_bool(const std::string &obj, const char* key){
+    size_t p = json_find_value(obj, key);
+    return p != std::string::npos && obj.compare(p, 4, "true") == 0;
+}
+
+// ---------- AI: Ollama HTTP API ----------
+// Streams POST /api/generate and hands each NDJSON object to on_line. Returns -1
+// when the server cannot be reached (caller falls back to the CLI), 0 otherwise.
+static int ollama_http_post(const char* path, const std::string &body, const std::atomic<bool>* cancel,
+                            const std::function<void(const std::string&)> &on_line){
+    std::string host = "127.0.0.1", port = "11434";
+    if(const char* e = getenv("OLLAMA_HOST")){
+        std::string h = e;
+        size_t scheme = h.find("://");
+        if(scheme != std::string::npos) h = h.substr(scheme + 3);
+        size_t slash = h.find('/');
+        if(slash != std::string::npos) h = h.substr(0, slash);
+        size_t colon = h.rfind(':');
+        if(colon != std::string::npos){ port = h.substr(colon + 1); h = h.substr(0, colon); }
+        if(!h.empty() && h != "0.0.0.0") host = h;
+    }
+    addrinfo hints{}; hints.ai_family = AF_UNSPEC; hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+    int fd = -1;
+    for(addrinfo* a = res; a; a = a->ai_next){
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if(fd < 0) continue;
+        if(connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+        close(fd); fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd < 0) return -1;
+
+    std::string req = std::string("POST ") + path + " HTTP/1.1\r\nHost: " + host + ":" + port +
+                      "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) +
+                      "\r\nConnection: close\r\n\r\n" + body;
+    for(size_t off = 0; off < req.size();){
+        ssize_t n = send(fd, req.data() + off, req.size() - off, MSG_NOSIGNAL);
+        if(n <= 0){ close(fd); return -1; }
+        off += (size_t)n;
+    }
+
+    std::string raw, payload, line;
+    bool in_body = false, chunked = false;
+    size_t chunk_left = 0;
+    char buf[4096];
+    for(;;){
+        if(cancel && cancel->load()) break; // closing the socket aborts generation server-side
+        fd_set rf; FD_ZERO(&rf); FD_SET(fd, &rf);
+        timeval tv = {0, 50000};
+        int r = select(fd+1, &rf, NULL, NULL, &tv);
+        if(r < 0 && errno != EINTR) break;
+        if(r <= 0) continue;
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0) break;
+        raw.append(buf, (size_t)n);
+        if(!in_body){
+            size_t hdr_end = raw.find("\r\n\r\n");
+            if(hdr_end == std::string::npos) continue;
+            std::string hdr = raw.substr(0, hdr_end);
+            std::transform(hdr.begin(), hdr.end(), hdr.begin(), [](unsigned char c){ return (char)std::tolower(c); });
+            chunked = hdr.find("transfer-encoding: chunked") != std::string::npos;
+            raw.erase(0, hdr_end + 4);
+            in_body = true;
+        }
+        // de-chunk into payload
+        if(!chunked){ payload += raw; raw.clear(); }
+        while(chunked && !raw.empty()){
+            if(chunk_left == 0){
+                size_t eol = raw.find("\r\n");
+                if(eol == std::string::npos) break;
+                if(eol == 0){ raw.erase(0, 2); continue; } // CRLF after a chunk
+                chunk_left = strtoul(raw.substr(0, eol).c_str(), nullptr, 16);
+                raw.erase(0, eol + 2);
+                if(chunk_left == 0){ raw.clear(); break; }
+            }
+            size_t take = std::min(chunk_left, raw.size());
+            payload.append(raw, 0, take);
+            raw.erase(0, take);
+            chunk_left -= take;
+        }
+        size_t nl;
+        while((nl = payload.find('\n')) != std::string::npos){
+            line.assign(payload, 0, nl);
+            payload.erase(0, nl + 1);
+            if(!line.empty()) on_line(line);
+        }
+    }
+    if(!payload.empty() && !(cancel && cancel->load())) on_line(payload);
+    close(fd);
+    return 0;
+}
+
+// ---------- AI backends ----------
+#ifdef CEREBRO_WITH_LLAMA
+// Restrict the calling thread (and threads it spawns, e.g. a ggml pool) to every
+// CPU except RENDER_CPU. No-op on single-CPU hosts.
+static void pin_current_thread_away_from_render(){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 2) return;
+    cpu_set_t set; CPU_ZERO(&set);
+    for(long c=0;c<cpus && c<CPU_SETSIZE;++c) if(c != RENDER_CPU) CPU_SET(c, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+#endif
+
+// One model call. Backends fill in timings so callers can separate model time from
+// the terminal's own overhead.
+struct AiCall {
+    std::string system, prompt;
+    const std::atomic<bool>* cancel = nullptr; // polled while waiting
+    bool low_priority = false;                 // speculative work
+    int seed = -1;                             // sampling overrides, -1 == backend default
+    float temperature = -1;
+    std::string model;                         // empty == AI_MODEL (ignored by file-backed backends)
+};
+struct AiGeneration {
+    std::string text;
+    double ttft = 0;   // seconds from call to first token
+    double total = 0;  // seconds from call to last token
+    int tokens = 0;
+    double logprob = 0;      // sum over generated tokens, when the backend reports it
+    bool has_logprob = false;
+    std::string model_id;    // model that produced text (AiBackend::model_id)
+};
+struct AiBackend {
+    virtual ~AiBackend() = default;
+    virtual const char* name() const = 0;
+    // Blocking. Returns false when the backend cannot be used at all, so the
+    // caller can fall back to another one.
+    virtual bool generate(const AiCall &call, AiGeneration &out) = 0;
+    // Load the model (and its prompt prefix) ahead of the first request and keep it
+    // resident. Returns the cold-load time in seconds, or a negative value when the
+    // backend has nothing to warm.
+    virtual double warm_up(const std::string &model){ (void)model; return -1; }
+    // Identity of the model that answers calls for model; part of the cache key.
+    virtual std::string model_id(const std::string &model) const { return model.empty() ? AI_MODEL : model; }
+    // False once the backend is known not to work (e.g. its model failed to load).
+    virtual bool available() const { return true; }
+    // n samples of the same prompt. The default issues them concurrently so a
+    // server that batches parallel requests (OLLAMA_NUM_PARALLEL >= n) decodes
+    // them together and the wall time stays close to a single generation.
+    virtual bool generate_n(const AiCall &call, int n, std::vector<AiGeneration> &out){
+        out.assign((size_t)n, AiGeneration());
+        std::vector<char> ok((size_t)n, 0);
+        std::vector<std::thread> workers;
+        for(int i=1;i<n;++i){
+            workers.emplace_back([&, i](){
+                AiCall c = call;
+                c.seed = 1000 + i;
+                c.temperature = 0.8f;
+                ok[(size_t)i] = generate(c, out[(size_t)i]);
+            });
+        }
+        AiCall first = call; // sample 0 is the greedy answer
+        first.temperature = 0.0f;
+        ok[0] = generate(first, out[0]);
+        for(std::thread &t : workers) t.join();
+        return ok[0] != 0;
+    }
+};
+
+// `ollama run` through sh; cancel kills the client's process group.
+struct OllamaCliBackend : AiBackend {
+    const char* name() const override { return "ollama-cli"; }
+    bool generate(const AiCall &call, AiGeneration &g) override {
+        double t0 = now_sec();
+        g.text = run(call.system + "\n" + call.prompt, call.model.empty() ? AI_MODEL : call.model, call.cancel, call.low_priority, g.ttft);
+        g.total = now_sec() - t0;
+        g.ttft = g.ttft > 0 ? g.ttft - t0 : g.total;
+        g.tokens = (int)(g.text.size() / 4);
+        return true;
+    }
+    static std::string run(const std::string& prompt, const std::string &model, const std::atomic<bool>* cancel, bool low_priority, double &first_byte_at){
+        std::string esc = shell_escape_single_quotes(prompt);
+        std::string cmd = "echo '" + esc + "' | ollama run --format json " + model + " 2>/dev/null";
+        int pfd[2];
+        if(pipe2(pfd, O_CLOEXEC) != 0) return "[AI error: pipe failed]";
+        pid_t pid = fork();
+        if(pid < 0){ close(pfd[0]); close(pfd[1]); return "[AI error: fork failed]"; }
+        if(pid == 0){
+            setpgid(0, 0); // own group so cancel can kill the whole pipeline
+            if(low_priority){ int rc = nice(10); (void)rc; }
+            dup2(pfd[1], STDOUT_FILENO);
+            execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*)NULL);
+            _exit(127);
+        }
+        close(pfd[1]);
+        std::string out;
+        char buf[4096];
+        bool cancelled = false;
+        for(;;){
+            if(cancel && cancel->load()){ cancelled = true; kill(-pid, SIGTERM); break; }
+            fd_set rf; FD_ZERO(&rf); FD_SET(pfd[0], &rf);
+            timeval tv = {0, 50000};
+            int r = select(pfd[0]+1, &rf, NULL, NULL, &tv);
+            if(r < 0 && errno != EINTR) break;
+            if(r <= 0) continue;
+            ssize_t n = read(pfd[0], buf, sizeof(buf));
+            if(n <= 0) break;
+            if(out.empty()) first_byte_at = now_sec();
+            out.append(buf, (size_t)n);
+        }
+        close(pfd[0]);
+        int status = 0;
+        waitpid(pid, &status, 0);
+        return cancelled ? std::string() : out;
+    }
+};
+
+// Ollama HTTP API: stable system prefix, keep_alive, streamed tokens.
+struct OllamaHttpBackend : AiBackend {
+    const char* name() const override { return "ollama"; }
+    bool generate(const AiCall &call, AiGeneration &g) override {
+        std::string options = "\"num_predict\":" + std::to_string(AI_MAX_TOKENS);
+        if(call.seed >= 0) options += ",\"seed\":" + std::to_string(call.seed);
+        if(call.temperature >= 0) options += ",\"temperature\":" + std::to_string(call.temperature);
+        std::string body = std::string("{\"model\":\"") + json_escape(call.model.empty() ? AI_MODEL : call.model) +
+                           "\",\"system\":\"" + json_escape(call.system) +
+                           "\",\"prompt\":\"" + json_escape(call.prompt) +
+                           "\",\"format\":" + AI_REPLY_SCHEMA +
+                           ",\"stream\":true,\"logprobs\":true,\"keep_alive\":\"" + AI_KEEP_ALIVE + "\"" +
+                           ",\"options\":{" + options + "}}";
+        std::string piece, err;
+        double t0 = now_sec();
+        int rc = ollama_http_post("/api/generate", body, call.cancel, [&](const std::string &obj){
+            if(json_get_string(obj, "response", piece) && !piece.empty()){
+                if(g.tokens == 0) g.ttft = now_sec() - t0;
+                g.text += piece;
+                g.tokens++;
+            }
+            // servers without logprob support simply omit the field
+            if(json_sum_numbers(obj, "logprob", g.logprob) > 0) g.has_logprob = true;
+            if(json_get_string(obj, "error", piece)) err = piece;
+            double load_ns;
+            if(json_get_bool(obj, "done") && json_get_number(obj, "load_duration", load_ns) && load_ns > AI_COLD_LOAD_NS)
+                ai_metrics.model_load.record((uint64_t)(load_ns / 1000)); // this request paid a cold load
+        });
+        if(rc < 0) return false;
+        g.total = now_sec() - t0;
+        if(g.text.empty() && !err.empty()) g.text = "[AI error: " + err + "]";
+        return true;
+    }
+    // One-token request with the real system prompt: loads the model and fills
+    // the KV cache for the shared prefix.
+    double warm_up(const std::string &model) override {
+        std::string body = std::string("{\"model\":\"") + json_escape(model.empty() ? AI_MODEL : model) +
+                           "\",\"system\":\"" + json_escape(AI_SYSTEM_PROMPT) +
+                           "\",\"prompt\":\"" + json_escape(ai_user_prompt("list files")) +
+                           "\",\"stream\":false,\"keep_alive\":\"" + AI_KEEP_ALIVE + "\",\"options\":{\"num_predict\":1}}";
+        double load_ns = -1;
+        if(ollama_http_post("/api/generate", body, nullptr, [&](const std::string &obj){
+            json_get_number(obj, "load_duration", load_ns);
+        }) < 0) return -1;
+        return load_ns < 0 ? -1 : load_ns / 1e9;
+    }
+};
+
+// Deterministic stand-in for benchmarks: replays a scripted reply as ~4-byte
+// tokens (wrapped in the JSON reply shape) after a fixed time to first token, at
+// a fixed token rate.
+// CEREBRO_MOCK_TTFT_MS, CEREBRO_MOCK_TPS, and CEREBRO_MOCK_SCRIPT (lines of
+// "request substring<TAB>reply[<TAB>alternative...]"; the first matching line
+// wins, sampled calls rotate through the alternatives by seed).
+struct MockBackend : AiBackend {
+    double ttft = 0.25, tps = 20;
+    double load = 0;                 // CEREBRO_MOCK_LOAD_MS, paid by the first call or warm-up
+    std::once_flag loaded;
+    std::vector<std::pair<std::string, std::vector<std::string>>> script;
+    std::vector<std::string> fallback = {"ls -la"};
+
+    MockBackend(){
+        if(const char* e = getenv("CEREBRO_MOCK_TTFT_MS")) ttft = atof(e) / 1000.0;
+        if(const char* e = getenv("CEREBRO_MOCK_TPS")) tps = std::max(0.1, atof(e));
+        if(const char* e = getenv("CEREBRO_MOCK_LOAD_MS")) load = atof(e) / 1000.0;
+        if(const char* e = getenv("CEREBRO_MOCK_SCRIPT")){
+            if(FILE* f = fopen(e, "r")){
+                char line[4096];
+                while(fgets(line, sizeof(line), f)){
+                    std::string l = line;
+                    while(!l.empty() && (l.back()=='\n' || l.back()=='\r')) l.pop_back();
+                    std::vector<std::string> fields;
+                    std::stringstream ss(l); std::string f;
+                    while(std::getline(ss, f, '\t')) fields.push_back(f);
+                    if(fields.size() >= 2) script.emplace_back(fields[0], std::vector<std::string>(fields.begin() + 1, fields.end()));
+                }
+                fclose(f);
+            }
+        }
+    }
+    const char* name() const override { return "mock"; }
+    double warm_up(const std::string &) override {
+        double paid = 0;
+        std::call_once(loaded, [&](){ usleep((useconds_t)(load * 1e6)); paid = load; });
+        return paid;
+    }
+    bool generate(const AiCall &call, AiGeneration &g) override {
+        double paid = warm_up(call.model); // concurrent callers wait for an in-progress load
+        if(paid * 1e9 > AI_COLD_LOAD_NS) record_us(ai_metrics.model_load, paid);
+        const std::vector<std::string>* replies = &fallback;
+        for(auto &e : script) if(call.prompt.find(e.first) != std::string::npos){ replies = &e.second; break; }
+        size_t pick = call.seed >= 0 ? (size_t)call.seed % replies->size() : 0;
+        const std::string reply = "{\"command\": \"" + json_escape((*replies)[pick]) + "\"}";
+        double t0 = now_sec();
+        for(size_t off = 0; off < reply.size(); off += 4){
+            double due = t0 + ttft + (double)g.tokens / tps;
+            while(now_sec() < due){
+                if(call.cancel && call.cancel->load()){ g.text.clear(); return true; }
+                double left = due - now_sec();
+                if(left > 0) usleep((useconds_t)(std::min(left, 0.01) * 1e6));
+            }
+            if(g.tokens == 0) g.ttft = now_sec() - t0;
+            g.text += reply.substr(off, 4);
+            g.tokens++;
+            g.logprob -= 0.05 * (double)(pick + 1);
+        }
+        g.has_logprob = true;
+        g.total = now_sec() - t0;
+        return true;
+    }
+};
+
+#ifdef CEREBRO_WITH_LLAMA
+// AI_REPLY_SCHEMA as a grammar. No escapes for control characters: a command is
+// one line.
+static const char* AI_REPLY_GBNF =
+    "root ::= \"{\\\"command\\\": \\\"\" char+ \"\\\"}\"\n"
+    "char ::= [^\"\\\\\\x00-\\x1f] | \"\\\\\" ([\"\\\\/] | \"u\" [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F])\n";
+
+// In-process llama.cpp backend for hosts without a reachable ollama
+// (CEREBRO_AI_BACKEND=llama, CEREBRO_LLAMA_MODEL=/path/model.gguf). The model and
+// the KV cache of the system prompt stay resident; each request only evaluates
+// its own tokens. The n candidates of generate_n share one prompt evaluation and
+// are decoded as n sequences in the same batch, each constrained by AI_REPLY_GBNF.
+struct LlamaBackend : AiBackend {
+    std::string path;
+    std::mutex mtx;                  // one context; calls are serialized
+    std::once_flag load_once;
+    llama_model* model = nullptr;
+    llama_context* ctx = nullptr;
+    const llama_vocab* vocab = nullptr;
+    std::vector<llama_token> prefix; // system prompt tokens, kept in the KV cache
+    std::string prefix_text;
+    bool prefix_valid = false;       // prefix is in the KV cache at positions 0..
+    int n_threads = 1;
+    bool loaded = false;
+    std::atomic<bool> load_failed{false};
+
+    explicit LlamaBackend(const std::string &p) : path(p) {}
+    ~LlamaBackend() override {
+        if(ctx) llama_free(ctx);
+        if(model) llama_model_free(model);
+    }
+    const char* name() const override { return "llama"; }
+    std::string model_id(const std::string &) const override { return "llama:" + path.substr(path.find_last_of('/') + 1); }
+    bool available() const override { return !load_failed.load(); }
+
+    std::string render(const std::string &system, const std::string *user){
+        const char* tmpl = llama_model_chat_template(model, nullptr);
+        llama_chat_message msgs[2] = {{"system", system.c_str()}, {"user", user ? user->c_str() : ""}};
+        size_t n = user ? 2 : 1;
+        std::vector<char> buf(4096);
+        int len = llama_chat_apply_template(tmpl, msgs, n, user != nullptr, buf.data(), (int32_t)buf.size());
+        if(len > (int)buf.size()){
+            buf.resize((size_t)len);
+            len = llama_chat_apply_template(tmpl, msgs, n, user != nullptr, buf.data(), (int32_t)buf.size());
+        }
+        if(len < 0) return user ? system + "\n" + *user + "\n" : system + "\n"; // no usable template
+        return std::string(buf.data(), (size_t)len);
+    }
+
+    std::vector<llama_token> tokenize(const std::string &text, bool add_special){
+        std::vector<llama_token> toks(text.size() + 8);
+        int n = llama_tokenize(vocab, text.c_str(), (int32_t)text.size(), toks.data(), (int32_t)toks.size(), add_special, true);
+        if(n < 0){
+            toks.resize((size_t)-n);
+            n = llama_tokenize(vocab, text.c_str(), (int32_t)text.size(), toks.data(), (int32_t)toks.size(), add_special, true);
+        }
+        toks.resize((size_t)std::max(n, 0));
+        return toks;
+    }
+
+    // Decode toks at positions pos.. on seq 0; logits only for the last one.
+    bool decode_prompt(const std::vector<llama_token> &toks, size_t from, llama_pos pos){
+        const size_t chunk = 512;
+        for(size_t i = from; i < toks.size(); i += chunk){
+            size_t n = std::min(chunk, toks.size() - i);
+            llama_batch b = llama_batch_init((int32_t)n, 0, 1);
+            for(size_t k=0;k<n;++k){
+                b.token[k] = toks[i + k];
+                b.pos[k] = pos + (llama_pos)(i - from + k);
+                b.n_seq_id[k] = 1;
+                b.seq_id[k][0] = 0;
+                b.logits[k] = (i + k == toks.size() - 1);
+            }
+            b.n_tokens = (int32_t)n;
+            int rc = llama_decode(ctx, b);
+            llama_batch_free(b);
+            if(rc != 0) return false;
+        }
+        return true;
+    }
+
+    void load(){
+        pin_current_thread_away_from_render();
+        llama_backend_init();
+        llama_model_params mp = llama_model_default_params();
+        mp.n_gpu_layers = 0;
+        model = llama_model_load_from_file(path.c_str(), mp);
+        if(!model) return;
+        vocab = llama_model_get_vocab(model);
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = (int)std::max(1L, cpus - 1); // RENDER_CPU stays free for the render thread
+        llama_context_params cp = llama_context_default_params();
+        cp.n_ctx = 1024 * AI_MAX_CANDIDATES;
+        cp.n_batch = 512;
+        cp.n_seq_max = AI_MAX_CANDIDATES;
+        cp.n_threads = n_threads;
+        cp.n_threads_batch = n_threads;
+        ctx = llama_init_from_model(model, cp);
+        if(!ctx) return;
+        prefix_text = render(AI_SYSTEM_PROMPT, nullptr);
+        prefix = tokenize(prefix_text, true);
+        prefix_valid = decode_prompt(prefix, 0, 0);
+        loaded = true;
+    }
+
+    double warm_up(const std::string &) override {
+        double t0 = now_sec(), paid = -1;
+        std::call_once(load_once, [&](){ load(); load_failed.store(!loaded); paid = now_sec() - t0; });
+        return paid;
+    }
+
+    bool generate(const AiCall &call, AiGeneration &out) override {
+        std::vector<AiGeneration> gens;
+        if(!generate_n(call, 1, gens)) return false;
+        out = gens[0];
+        return true;
+    }
+
+    bool generate_n(const AiCall &call, int n, std::vector<AiGeneration> &out) override {
+        warm_up(call.model);
+        if(!loaded) return false;
+        std::lock_guard<std::mutex> g(mtx);
+        pin_current_thread_away_from_render();
+        n = std::clamp(n, 1, AI_MAX_CANDIDATES);
+        out.assign((size_t)n, AiGeneration());
+        double t0 = now_sec();
+
+        // Reuse the cached system prefix when the rendered prompt starts with it.
+        std::vector<llama_token> toks = tokenize(render(call.system, &call.prompt), true);
+        bool starts = !prefix.empty() && toks.size() > prefix.size() && std::equal(prefix.begin(), prefix.end(), toks.begin());
+        size_t keep = starts && prefix_valid ? prefix.size() : 0;
+        llama_memory_t mem = llama_get_memory(ctx);
+        llama_memory_seq_rm(mem, -1, (llama_pos)keep, -1);
+        for(int s=1;s<AI_MAX_CANDIDATES;++s) llama_memory_seq_rm(mem, s, -1, -1);
+        bool ok = decode_prompt(toks, keep, (llama_pos)keep);
+        prefix_valid = ok && starts;
+        if(!ok){ out[0].text = "[AI error: llama_decode failed]"; return true; }
+        for(int s=1;s<n;++s) llama_memory_seq_cp(mem, 0, s, -1, -1);
+
+        std::vector<llama_sampler*> samplers((size_t)n);
+        for(int s=0;s<n;++s){
+            llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+            llama_sampler_chain_add(chain, llama_sampler_init_grammar(vocab, AI_REPLY_GBNF, "root"));
+            float temp = s == 0 ? (call.temperature >= 0 ? call.temperature : 0.0f) : 0.8f;
+            if(temp <= 0){
+                llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+            } else {
+                llama_sampler_chain_add(chain, llama_sampler_init_top_k(40));
+                llama_sampler_chain_add(chain, llama_sampler_init_top_p(0.9f, 1));
+                llama_sampler_chain_add(chain, llama_sampler_init_temp(temp));
+                llama_sampler_chain_add(chain, llama_sampler_init_dist((uint32_t)(call.seed >= 0 ? call.seed : 1000) + (uint32_t)s));
+            }
+            samplers[(size_t)s] = chain;
+        }
+
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+        std::vector<int> logit_idx((size_t)n, -1); // batch index holding each seq's logits
+        std::vector<char> done((size_t)n, 0);
+        llama_pos pos = (llama_pos)toks.size();
+        llama_batch b = llama_batch_init(n, 0, n);
+        for(int step = 0; step < AI_MAX_TOKENS; ++step){
+            if(call.cancel && call.cancel->load()) break;
+            b.n_tokens = 0;
+            for(int s=0;s<n;++s){
+                if(done[(size_t)s]) continue;
+                int idx = step == 0 ? -1 : logit_idx[(size_t)s];
+                const float* logits = llama_get_logits_ith(ctx, idx);
+                llama_token tok = llama_sampler_sample(samplers[(size_t)s], ctx, idx);
+                AiGeneration &gen = out[(size_t)s];
+                if(logits){
+                    float mx = logits[0];
+                    for(int v=1;v<n_vocab;++v) mx = std::max(mx, logits[v]);
+                    double z = 0;
+                    for(int v=0;v<n_vocab;++v) z += std::exp((double)(logits[v] - mx));
+                    gen.logprob += (double)(logits[tok] - mx) - std::log(z);
+                    gen.has_logprob = true;
+                }
+                char piece[256];
+                int len = llama_token_to_piece(vocab, tok, piece, sizeof(piece), 0, false);
+                bool eog = llama_vocab_is_eog(vocab, tok);
+                std::string p = len > 0 ? std::string(piece, (size_t)len) : std::string();
+                if(!eog){
+                    if(gen.tokens == 0) gen.ttft = now_sec() - t0;
+                    gen.text += p;
+                    gen.tokens++;
+                }
+                // the grammar only allows end-of-generation once the object is closed
+                if(eog){
+                    done[(size_t)s] = 1;
+                    gen.total = now_sec() - t0;
+                    continue;
+                }
+                logit_idx[(size_t)s] = b.n_tokens;
+                b.token[b.n_tokens] = tok;
+                b.pos[b.n_tokens] = pos;
+                b.n_seq_id[b.n_tokens] = 1;
+                b.seq_id[b.n_tokens][0] = s;
+                b.logits[b.n_tokens] = true;
+                b.n_tokens++;
+            }
+            if(b.n_tokens == 0) break;
+            if(llama_decode(ctx, b) != 0) break;
+            pos++;
+        }
+        llama_batch_free(b);
+        for(llama_sampler* sm : samplers) llama_sampler_free(sm);
+        for(AiGeneration &gen : out) if(gen.total == 0) gen.total = now_sec() - t0;
+        return true;
+    }
+};
+
+// A small and a large GGUF file behind the router (CEREBRO_LLAMA_MODEL_SMALL):
+// calls for the router's small model go to the small file, all others to the large one.
+struct LlamaRoutedBackend : AiBackend {
+    LlamaBackend small, large;
+    std::string small_model; // AiCall::model that selects the small file
+
+    LlamaRoutedBackend(const std::string &small_path, const std::string &large_path, const std::string &small_name)
+        : small(small_path), large(large_path), small_model(small_name) {}
+    LlamaBackend &pick(const std::string &model){ return model == small_model ? small : large; }
+    const LlamaBackend &pick(const std::string &model) const { return model == small_model ? small : large; }
+
+    const char* name() const override { return "llama"; }
+    std::string model_id(const std::string &model) const override { return pick(model).model_id(model); }
+    bool available() const override { return large.available(); }
+    double warm_up(const std::string &model) override { return pick(model).warm_up(model); }
+    bool generate(const AiCall &call, AiGeneration &out) override { return pick(call.model).generate(call, out); }
+    bool generate_n(const AiCall &call, int n, std::vector<AiGeneration> &out) override { return pick(call.model).generate_n(call, n, out); }
+};
+#endif
+
+// ---------- AI: model routing ----------
+// Requests go to a small fast model unless they look complex, the user asks for
+// a "better" answer (or re-asks one they just rejected), or the small model's
+// candidates are not confident; those go to (or escalate to) the large model.
+// CEREBRO_AI_ROUTER=0 disables routing; CEREBRO_AI_MODEL_SMALL / _LARGE pick the
+// models, CEREBRO_AI_ROUTE_COMPLEXITY / _CONFIDENCE the thresholds.
+struct AiRouter {
+    bool enabled = true;
+    std::string small = "qwen2.5:1.5b";
+    std::string large = AI_MODEL;
+    double complexity_threshold = 0.6;  // >= this goes straight to the large model
+    double confidence_threshold = 0.5;  // small-model answers below this escalate
+    // the backend rejected the small model (e.g. not pulled): route around it
+    // until small_retry_at, backing off while it keeps failing
+    std::atomic<double> small_retry_at{0};
+    std::atomic<int> small_failures{0};
+
+    bool small_down() const { return now_sec() < small_retry_at.load(); }
+    void small_failed(){
+        int n = std::min(small_failures.fetch_add(1), 4);
+        small_retry_at.store(now_sec() + AI_SMALL_RETRY * (1 << n));
+    }
+};
+static AiRouter ai_router;
+
+static std::unique_ptr<AiBackend> ai_backend;          // primary, chosen at startup
+static std::unique_ptr<AiBackend> ai_fallback_backend; // used when the primary is unreachable
+
+static void ai_backend_init(){
+    std::string which = getenv("CEREBRO_AI_BACKEND") ? getenv("CEREBRO_AI_BACKEND") : "ollama";
+    if(which == "mock") ai_backend.reset(new MockBackend());
+    else if(which == "ollama-cli") ai_backend.reset(new OllamaCliBackend());
+#ifdef CEREBRO_WITH_LLAMA
+    else if(which == "llama" && getenv("CEREBRO_LLAMA_MODEL")){
+        std::string path = getenv("CEREBRO_LLAMA_MODEL");
+        if(const char* small = getenv("CEREBRO_LLAMA_MODEL_SMALL")) ai_backend.reset(new LlamaRoutedBackend(small, path, ai_router.small));
+        else {
+            ai_backend.reset(new LlamaBackend(path));
+            ai_router.enabled = false; // one file: a "large" re-run would only repeat the answer
+        }
+        ai_fallback_backend.reset(new OllamaHttpBackend()); // the old path stays available
+    }
+#endif
+    else {
+        ai_backend.reset(new OllamaHttpBackend());
+        ai_fallback_backend.reset(new OllamaCliBackend());
+    }
+}
+
+enum AiRoute { ROUTE_SMALL, ROUTE_LARGE_COMPLEX, ROUTE_LARGE_BETTER, ROUTE_ESCALATED, ROUTE_COUNT };
+
+// 0..1 estimate of how hard the request is: length plus words that usually mean
+// pipelines, conditions or loops.
+static double ai_request_complexity(const std::string &request){
+    static const char* hard[] = {"then", "pipe", "each", "every", "recursive", "recursively", "unless", "except",
+                                 "but", "if", "while", "replace", "loop", "script", "between", "older", "newer",
+                                 "largest", "smallest", "sort", "count", "group", "json", "regex", "and"};
+    std::vector<std::string> words;
+    std::stringstream ss(normalize_ai_request(request)); std::string w;
+    while(ss >> w) words.push_back(w);
+    double score = words.size() / 16.0;
+    for(const std::string &x : words) for(const char* h : hard) if(x == h){ score += 0.15; break; }
+    return std::min(1.0, score);
+}
+
+// Strip a "better" marker ("better: ...", "... !better") from the request.
+static bool ai_strip_better(std::string &request){
+    std::string n = normalize_ai_request(request);
+    if(n.rfind("better:", 0) == 0){
+        request = request.substr(request.find(':') + 1);
+        return true;
+    }
+    size_t p = n.rfind("!better");
+    if(p != std::string::npos && p + 7 == n.size()){
+        request = request.substr(0, request.rfind("!better"));
+        return true;
+    }
+    return false;
+}
+
+// ---------- AI: model warm-up / keep-alive ----------
+// Fired on a detached thread at startup, on focus and every AI_KEEP_ALIVE_PING
+// seconds, so the first Shift+Enter does not pay the model load. Never waited on.
+static bool ai_warmup_enabled = true;            // CEREBRO_AI_WARMUP=0 disables
+static std::atomic<bool> ai_warmup_running(false);
+static double ai_last_warmup = -1e9;             // main thread
+
+static void ai_warm_up_async(){
+    if(!ai_warmup_enabled || ai_warmup_running.exchange(true)) return;
+    ai_last_warmup = now_sec();
+    std::thread([](){
+        double load = ai_backend->warm_up(ai_router.enabled && !ai_router.small_down() ? ai_router.small : ai_router.large);
+        if(load * 1e9 > AI_COLD_LOAD_NS) record_us(ai_metrics.model_load, load);
+        ai_warmup_running.store(false);
+    }).detach();
+}
+
+static void ai_keep_alive_tick(double now){
+    if(now - ai_last_warmup >= AI_KEEP_ALIVE_PING) ai_warm_up_async();
+}
+
+static void focus_callback(GLFWwindow*, int focused){
+    if(focused && now_sec() - ai_last_warmup >= 60.0) ai_warm_up_async();
+}
+
+// ---------- AI: run model blocking (safe) ----------
+static AiGeneration run_llm_blocking(const std::string& user_prompt, const std::atomic<bool>* cancel = nullptr, bool low_priority = false, const std::string &model = std::string()){
+    AiCall call;
+    call.model = model;
+    call.system = AI_SYSTEM_PROMPT;
+    call.prompt = user_prompt;
+    call.cancel = cancel;
+    call.low_priority = low_priority;
+    AiGeneration g;
+    if(!ai_backend) ai_backend_init();
+    if(ai_backend->generate(call, g)) g.model_id = ai_backend->model_id(model);
+    else {
+        g = AiGeneration();
+        if(ai_fallback_backend && ai_fallback_backend->generate(call, g)) g.model_id = ai_fallback_backend->model_id(model);
+        else g.text = "[AI error: backend unavailable]";
+    }
+    if(cancel && cancel->load()) g.text.clear();
+    return g;
+}
+
+// n samples in one batched backend call; n == 1 is a plain run_llm_blocking.
+static std::vector<AiGeneration> run_llm_candidates(const std::string& user_prompt, int n, const std::atomic<bool>* cancel = nullptr, bool low_priority = false, const std::string &model = std::string()){
+    if(n <= 1) return {run_llm_blocking(user_prompt, cancel, low_priority, model)};
+    AiCall call;
+    call.model = model;
+    call.system = AI_SYSTEM_PROMPT;
+    call.prompt = user_prompt;
+    call.cancel = cancel;
+    call.low_priority = low_priority;
+    std::vector<AiGeneration> gens;
+    if(!ai_backend) ai_backend_init();
+    const AiBackend* used = ai_backend.get();
+    if(!ai_backend->generate_n(call, n, gens)){
+        gens.clear();
+        used = ai_fallback_backend.get();
+        if(!ai_fallback_backend || !ai_fallback_backend->generate_n(call, n, gens)){
+            gens.assign(1, AiGeneration());
+            gens[0].text = "[AI error: backend unavailable]";
+            used = nullptr;
+        }
+    }
+    if(used) for(AiGeneration &g : gens) g.model_id = used->model_id(model);
+    if(cancel && cancel->load()) gens.clear();
+    return gens;
+}
+
+// The command from a {"command": ...} reply; empty if the reply was cut short or
+// the command contains a control character (an embedded newline would run a
+// second command on confirm). Backend errors ("[AI error: ...]") pass through.
+static std::string ai_extract_command(const std::string &out){
+    if(out.rfind("[AI error", 0) == 0) return out;
+    size_t end = out.find_last_not_of(" \n\r\t");
+    std::string cmd;
+    if(end == std::string::npos || out[end] != '}' || !json_get_string(out, "command", cmd)) return std::string();
+    size_t a = cmd.find_first_not_of(" \t\r\n"), b = cmd.find_last_not_of(" \t\r\n");
+    if(a == std::string::npos) return std::string();
+    cmd = cmd.substr(a, b - a + 1);
+    for(unsigned char c : cmd) if(c < 0x20 || c == 0x7f) return std::string();
+    return cmd;
+}
+
+// Prompt the model for AI_CANDIDATES samples and return the distinct commands,
+// best first. Score: mean token log-probability, plus a bonus for samples that
+// agree with each other and for commands already in the shell history.
+static std::atomic<double> ai_last_model_time(0.0); // seconds spent in the backend by the last call
+static std::vector<std::string> ai_generate_with_model(const std::string &prompt, const std::string &model, const std::atomic<bool>* cancel,
+                                                       bool low_priority, double &confidence, bool &model_error, std::string &answered_by){
+    std::vector<AiGeneration> gens = run_llm_candidates(prompt, ai_candidates, cancel, low_priority, model);
+    answered_by = gens.empty() ? std::string() : gens[0].model_id;
+    double model_time = 0;
+    if(!gens.empty() && !gens[0].text.empty()){
+        const AiGeneration &g = gens[0];
+        ai_metrics.model_calls++;
+        record_us(ai_metrics.ttft, g.ttft);
+        record_us(ai_metrics.generation, g.total);
+        if(g.total > g.ttft && g.tokens > 1) ai_metrics.tokens_per_sec.record((uint64_t)((g.tokens - 1) / (g.total - g.ttft)));
+    }
+    struct Cand { std::string cmd; double logprob = -INFINITY; bool has_lp = false; int votes = 0; size_t first = 0; };
+    std::vector<Cand> cands;
+    for(size_t i=0;i<gens.size();++i){
+        model_time = std::max(model_time, gens[i].total);
+        std::string cmd = ai_extract_command(gens[i].text);
+        if(cmd.empty()) continue;
+        bool has_lp = gens[i].has_logprob && gens[i].tokens > 0;
+        auto it = std::find_if(cands.begin(), cands.end(), [&](const Cand &c){ return c.cmd == cmd; });
+        if(it == cands.end()){ cands.push_back(Cand{cmd, -INFINITY, false, 0, i}); it = cands.end() - 1; }
+        it->votes++;
+        if(has_lp){ it->has_lp = true; it->logprob = std::max(it->logprob, gens[i].logprob / gens[i].tokens); }
+    }
+    ai_last_model_time.store(model_time);
+    // log-probabilities only compare when every candidate has one; otherwise
+    // (backend without logprobs, or a mix) rank by agreement and history alone
+    bool all_lp = std::all_of(cands.begin(), cands.end(), [](const Cand &c){ return c.has_lp; });
+    auto score = [all_lp](const Cand &c){
+        return (all_lp ? c.logprob : 0.0) + std::log((double)c.votes) + AI_HISTORY_BONUS * std::log1p((double)history_index_count(c.cmd));
+    };
+    std::stable_sort(cands.begin(), cands.end(), [&](const Cand &a, const Cand &b){
+        double sa = score(a), sb = score(b);
+        return sa != sb ? sa > sb : a.first < b.first;
+    });
+    std::vector<std::string> out;
+    for(Cand &c : cands) if(c.cmd.rfind("[AI error", 0) != 0 || out.empty()) out.push_back(c.cmd);
+    // confidence: probability of the best answer when known, else how many samples agree
+    model_error = out.empty() || out[0].rfind("[AI error", 0) == 0;
+    confidence = 1.0;
+    if(!cands.empty()){
+        const Cand &best = cands[0];
+        if(best.has_lp) confidence = std::exp(best.logprob);
+        else if(gens.size() > 1) confidence = (double)best.votes / (double)gens.size();
+    }
+    return out;
+}
+
+// Route the request (see AiRouter) and return the ranked commands. answered_by
+// receives the identity of the model that produced them.
+static std::vector<std::string> ai_generate_commands(const std::string &request, const std::atomic<bool>* cancel = nullptr, bool low_priority = false,
+                                                     bool force_large = false, std::string* answered_by = nullptr){
+    std::string input_line = request;
+    double confidence = 1.0;
+    bool model_error = false;
+    std::string model_used;
+    if(!answered_by) answered_by = &model_used;
+    bool better = ai_router.enabled && (ai_strip_better(input_line) || force_large);
+    std::string prompt = ai_user_prompt(input_line, doc_index_lookup(input_line));
+    if(!ai_router.enabled) return ai_generate_with_model(prompt, std::string(), cancel, low_priority, confidence, model_error, *answered_by);
+
+    AiRoute route = ROUTE_SMALL;
+    if(better) route = ROUTE_LARGE_BETTER;
+    else if(ai_router.small_down() || ai_request_complexity(input_line) >= ai_router.complexity_threshold) route = ROUTE_LARGE_COMPLEX;
+
+    double t0 = now_sec();
+    std::vector<std::string> out;
+    if(route == ROUTE_SMALL){
+        out = ai_generate_with_model(prompt, ai_router.small, cancel, low_priority, confidence, model_error, *answered_by);
+        if(cancel && cancel->load()) return out;
+        if(model_error && out.size() <= 1) ai_router.small_failed(); // e.g. model not pulled
+        else ai_router.small_failures.store(0);
+        if(!model_error && confidence >= ai_router.confidence_threshold){
+            ai_metrics.route[ROUTE_SMALL]++;
+            record_us(ai_metrics.route_latency[ROUTE_SMALL], now_sec() - t0);
+            return out;
+        }
+        route = ROUTE_ESCALATED;
+    }
+    out = ai_generate_with_model(prompt, ai_router.large, cancel, low_priority, confidence, model_error, *answered_by);
+    ai_metrics.route[route]++;
+    record_us(ai_metrics.route_latency[route], now_sec() - t0);
+    return out;
+}
+
+// ---------- AI: request scheduling ----------
+// Every model request is an entry in ai_inflight keyed by its request key, so an
+// identical request arriving while one is running (double Shift+Enter, re-asking,
+// a speculation for the same text) attaches to it instead of starting another
+// inference. At most ai_max_inflight requests run at once; the rest wait for a
+// slot, foreground requests ahead of speculative ones, so a burst cannot take
+// the CPU away from the shell.
+struct AiInflight {
+    std::shared_ptr<std::atomic<bool>> cancel;
+    bool deliver = false;      // a Shift+Enter is waiting for this answer
+    uint64_t deliver_gen = 0;  // ai_generation of that Shift+Enter
+};
+static std::unordered_map<std::string, std::shared_ptr<AiInflight>> ai_inflight; // guarded by ai_mutex
+static int ai_max_inflight = 1;                  // CEREBRO_AI_MAX_INFLIGHT
+
+struct AiSlots {
+    std::mutex mtx;
+    std::condition_variable cv;
+    int active = 0, waiting_foreground = 0;
+};
+static AiSlots ai_slots;
+
+// Blocks until a slot is free; false if cancelled while waiting.
+static bool ai_slot_acquire(bool foreground, const std::atomic<bool>* cancel){
+    std::unique_lock<std::mutex> lk(ai_slots.mtx);
+    if(foreground) ai_slots.waiting_foreground++;
+    for(;;){
+        if(cancel && cancel->load()) break;
+        if(ai_slots.active < ai_max_inflight && (foreground || ai_slots.waiting_foreground == 0)){
+            ai_slots.active++;
+            if(foreground) ai_slots.waiting_foreground--;
+            return true;
+        }
+        ai_slots.cv.wait_for(lk, std::chrono::milliseconds(50));
+    }
+    if(foreground) ai_slots.waiting_foreground--;
+    return false;
+}
+
+static void ai_slot_release(){
+    { std::lock_guard<std::mutex> lk(ai_slots.mtx); ai_slots.active--; }
+    ai_slots.cv.notify_all();
+}
+
+// The model a cache lookup should expect to answer: the fallback's once the
+// primary is known not to work.
+static std::string ai_answering_model(const std::string &model){
+    if(ai_backend->available() || !ai_fallback_backend) return ai_backend->model_id(model);
+    return ai_fallback_backend->model_id(model);
+}
+
+// Model the router sends request to first ("" when routing is off).
+static std::string ai_route_model(const std::string &request){
+    if(!ai_router.enabled) return std::string();
+    std::string r = request;
+    if(ai_strip_better(r) || ai_router.small_down() || ai_request_complexity(r) >= ai_router.complexity_threshold) return ai_router.large;
+    return ai_router.small;
+}
+
+// Cached answer for request (request_key == ai_request_key(request)); key_out
+// receives the cache key it is stored under. Tries the routed model, then the
+// large model that escalated and "better" answers come from.
+static bool ai_cache_find(const std::string &request, const std::string &request_key, std::string &cmd_out, std::string &key_out){
+    std::string routed = ai_route_model(request);
+    std::vector<std::string> models = {routed};
+    if(ai_router.enabled && routed != ai_router.large) models.push_back(ai_router.large);
+    for(size_t i=0;i<models.size();++i){
+        std::string key = ai_cache_key(ai_answering_model(models[i]), request_key);
+        if(ai_cache_lookup(key, cmd_out, i + 1 == models.size())){ key_out = key; return true; }
+    }
+    return false;
+}
+
+// Start (or join) a model request for input_line. deliver: show the answer when
+// it arrives (Shift+Enter) rather than only filling the cache (speculation).
+// key is ai_request_key of the request without its "better" marker; the answer
+// is cached under it, replacing the one the user rejected.
+static void ai_request_start(const std::string &input_line, const std::string &key, bool deliver, uint64_t gen){
+    std::string base = input_line;
+    std::string id = key; // a "better" re-ask must not join a plain request for the same text
+    if(ai_router.enabled && ai_strip_better(base)) id += std::string("\0better", 7);
+    std::shared_ptr<AiInflight> req;
+    {
+        std::lock_guard<std::mutex> g(ai_mutex);
+        auto it = ai_inflight.find(id);
+        if(it != ai_inflight.end()){
+            if(deliver){ it->second->deliver = true; it->second->deliver_gen = gen; }
+            return;
+        }
+        req = std::make_shared<AiInflight>();
+        req->cancel = std::make_shared<std::atomic<bool>>(false);
+        req->deliver = deliver;
+        req->deliver_gen = gen;
+        ai_inflight[id] = req;
+    }
+    double enqueued = now_sec();
+    std::thread([input_line, key, id, deliver, enqueued, req](){
+        std::vector<std::string> cmds;
+        std::string cached, cache_key;
+        if(!deliver && ai_cache_find(input_line, key, cached, cache_key)){
+            cmds.push_back(cached);
+        } else if(ai_slot_acquire(deliver, req->cancel.get())){
+            if(deliver) record_us(ai_metrics.queue_wait, now_sec() - enqueued);
+            std::string answered_by;
+            cmds = ai_generate_commands(input_line, req->cancel.get(), !deliver, false, &answered_by);
+            ai_slot_release();
+            if(cmds.empty() && !req->cancel->load()) cmds.push_back("[AI error: empty reply]");
+            if(!cmds.empty() && cmds[0].rfind("[AI error", 0) != 0){
+                cache_key = ai_cache_key(answered_by, key);
+                ai_cache_store(cache_key, cmds[0]);
+            }
+        }
+        std::lock_guard<std::mutex> g(ai_mutex);
+        auto it = ai_inflight.find(id);
+        if(it != ai_inflight.end() && it->second == req) ai_inflight.erase(it);
+        if(req->cancel->load() || cmds.empty()) return;
+        if(req->deliver && req->deliver_gen == ai_generation){ // else answered or superseded meanwhile
+            ai_result = cmds[0];
+            ai_alternatives.assign(cmds.begin() + 1, cmds.end());
+            ai_origin = "";
+            ai_result_key = cache_key;
+            ai_ready = true;
+        }
+    }).detach();
+}
+
+// ---------- AI: speculative prefetch while typing ----------
+// Opt-in (CEREBRO_AI_PREFETCH=1). Once edits to shell_buffer pause for
+// AI_PREFETCH_DEBOUNCE seconds a low-priority request is started for the current
+// text; any further edit cancels it. Results land in the suggestion cache, and a
+// Shift+Enter for the same text while it is still running joins it.
+static bool ai_prefetch = false;
+static double last_edit_time = 0.0;
+static std::string last_spec_key;              // text already speculated (main thread)
+
+// Cancel speculative requests nobody is waiting for. Caller holds ai_mutex.
+static void ai_spec_cancel_locked(){
+    for(auto it = ai_inflight.begin(); it != ai_inflight.end();){
+        if(!it->second->deliver){ it->second->cancel->store(true); it = ai_inflight.erase(it); }
+        else ++it;
+    }
+}
+
+static void ai_note_edit(){
+    last_edit_time = now_sec();
+    if(!ai_prefetch) return;
+    last_spec_key.clear();
+    std::lock_guard<std::mutex> g(ai_mutex);
+    ai_spec_cancel_locked();
+}
+
+static void ai_prefetch_tick(double now){
+    if(!ai_prefetch || awaiting_confirm || input_blocked.load() || local_line_active) return;
+    if(now - last_edit_time < AI_PREFETCH_DEBOUNCE) return;
+    if(shell_buffer.find_first_not_of(' ') == std::string::npos) return;
+    std::string spec = ai_request_key(shell_buffer);
+    if(spec == last_spec_key) return;
+    last_spec_key = spec;
+    {
+        std::lock_guard<std::mutex> g(ai_mutex);
+        ai_spec_cancel_locked();
+    }
+    std::string base = shell_buffer;
+    if(ai_router.enabled) ai_strip_better(base);
+    ai_request_start(shell_buffer.substr(shell_buffer.find_first_not_of(' ')), ai_request_key(base), false, 0);
+}
+
+static void run_llm_async(const std::string &request, bool local_ok = true){
+    // re-asking a request whose answer was just rejected means "try harder":
+    // skip the cache and history and send it to the large model
+    std::string input_line = request;
+    bool better = false;
+    {
+        std::lock_guard<std::mutex> g(ai_mutex);
+        if(ai_router.enabled && !ai_last_rejected.empty() && normalize_ai_request(request) == ai_last_rejected){
+            input_line = "better: " + request;
+            better = true;
+        }
+        ai_last_rejected.clear();
+    }
+    std::string stripped = input_line;
+    if(ai_router.enabled && ai_strip_better(stripped)) better = true;
+    std::string key = ai_request_key(stripped);
+    std::string cached, cache_key;
+    if(!better && local_ok && ai_cache_find(input_line, key, cached, cache_key)){
+        std::lock_guard<std::mutex> g(ai_mutex);
+        ai_result = cached;
+        ai_alternatives.clear();
+        ai_origin = "cached";
+        ai_result_key = cache_key;
+        ai_ready = true;
+        return;
+    }
+    std::string local_cmd; float confidence = 0;
+    if(!better && local_ok && history_index_lookup(input_line, local_cmd, confidence) && confidence >= HISTORY_MATCH_CONFIDENCE){
+        std::lock_guard<std::mutex> g(ai_mutex);
+        ai_result = local_cmd;
+        ai_alternatives.clear();
+        ai_origin = "history";
+        ai_result_key.clear();
+        ai_metrics.history_hits++;
+        ai_ready = true;
+        if(!ai_refine) return;
+    }
+    uint64_t gen;
+    {
+        std::lock_guard<std::mutex> g(ai_mutex);
+        gen = ai_generation;
+        // speculation for other text is now pointless
+        for(auto it = ai_inflight.begin(); it != ai_inflight.end();){
+            if(it->first != key && !it->second->deliver){ it->second->cancel->store(true); it = ai_inflight.erase(it); }
+            else ++it;
+        }
+    }
+    ai_request_start(input_line, key, true, gen);
+}
+
+// ---------- AI: suggestion safety check ----------
+// Local, syscall-light review of a suggested command before the y/n prompt: the
+// line is split like the shell would (quotes, pipes, lists, redirections) and
+// each simple command is checked for destructive patterns, missing input files
+// and unknown programs. Findings are appended to the suggestion line.
+struct ShellCommand {
+    std::vector<std::string> argv;
+    std::vector<std::string> raw;       // argv before quote removal ($ and globs are checked on this)
+    std::vector<std::pair<std::string, std::string>> redirs; // operator, target
+    std::string sep;                    // operator before this command ("", "|", "&&", ...)
+};
+
+static std::vector<ShellCommand> shell_split(const std::string &line){
+    std::vector<ShellCommand> cmds(1);
+    std::string word, raw;
+    bool in_word = false;
+    std::string pending_redir;
+    auto end_word = [&](){
+        if(!in_word) return;
+        ShellCommand &c = cmds.back();
+        if(!pending_redir.empty()){ c.redirs.emplace_back(pending_redir, word); pending_redir.clear(); }
+        else { c.argv.push_back(word); c.raw.push_back(raw); }
+        word.clear(); raw.clear(); in_word = false;
+    };
+    auto new_cmd = [&](const std::string &sep){
+        end_word();
+        pending_redir.clear();
+        if(!cmds.back().argv.empty() || !cmds.back().redirs.empty()) cmds.emplace_back();
+        cmds.back().sep = sep;
+    };
+    for(size_t i = 0; i < line.size(); ++i){
+        char c = line[i];
+        char n = i + 1 < line.size() ? line[i+1] : 0;
+        if(c == '\''){
+            size_t e = line.find('\'', i + 1);
+            if(e == std::string::npos) e = line.size();
+            word.append(line, i + 1, e - i - 1); raw.append(line, i, e - i + 1);
+            in_word = true; i = e;
+        } else if(c == '"'){
+            raw.push_back(c); in_word = true;
+            for(++i; i < line.size() && line[i] != '"'; ++i){
+                if(line[i] == '\\' && i + 1 < line.size()){ raw.push_back(line[i]); ++i; }
+                word.push_back(line[i]); raw.push_back(line[i]);
+            }
+            raw.push_back('"');
+        } else if(c == '\\' && n){
+            word.push_back(n); raw.push_back(c); raw.push_back(n); in_word = true; ++i;
+        } else if(c == ' ' || c == '\t'){
+            end_word();
+        } else if(c == '#' && !in_word){
+            break;
+        } else if(c == '$' && n == '('){
+            new_cmd("$("); ++i;
+        } else if(c == '`' || c == '(' || c == ')' || c == '\n' || c == ';'){
+            new_cmd(std::string(1, c));
+        } else if(c == '|' || c == '&'){
+            if(c == '&' && n == '>'){ end_word(); pending_redir = "&>"; ++i; continue; }
+            std::string op(1, c);
+            if(n == c || (c == '|' && n == '&')){ op.push_back(n); ++i; }
+            new_cmd(op);
+        } else if(c == '<' || c == '>'){
+            bool fd = in_word && !word.empty() && std::all_of(word.begin(), word.end(), ::isdigit);
+            if(fd){ word.clear(); raw.clear(); in_word = false; } else end_word();
+            std::string op(1, c);
+            while(i + 1 < line.size() && (line[i+1] == '<' || line[i+1] == '>' || line[i+1] == '&' || line[i+1] == '|')) op.push_back(line[++i]);
+            pending_redir = op;
+        } else {
+            word.push_back(c); raw.push_back(c); in_word = true;
+        }
+    }
+    end_word();
+    if(cmds.back().argv.empty() && cmds.back().redirs.empty()) cmds.pop_back();
+    return cmds;
+}
+
+static bool shell_is_builtin(const std::string &w){
+    static const char* names[] = {":", "cd", "echo", "export", "source", ".", "alias", "unalias", "set", "unset", "exit", "read",
+        "printf", "test", "[", "[[", "]]", "type", "hash", "history", "jobs", "fg", "bg", "wait", "kill", "pwd", "pushd",
+        "popd", "dirs", "eval", "exec", "true", "false", "local", "declare", "typeset", "let", "shift", "trap", "umask",
+        "ulimit", "times", "command", "builtin", "enable", "help", "logout", "mapfile", "readarray", "return", "break",
+        "continue", "shopt", "suspend", "compgen", "complete", "disown", "getopts", "caller", "if", "then", "else", "elif",
+        "fi", "for", "while", "until", "do", "done", "case", "esac", "in", "function", "select", "time", "!", "{", "}", "coproc"};
+    for(const char* n : names) if(w == n) return true;
+    return false;
+}
+
+static bool shell_on_path(const std::string &prog){
+    return !path_lookup(prog).empty();
+}
+
+// Words that need the shell to expand them can't be checked here.
+static bool shell_word_expands(const std::string &raw){
+    bool sq = false, dq = false;
+    for(size_t i = 0; i < raw.size(); ++i){
+        char c = raw[i];
+        if(c == '\\' && !sq){ ++i; continue; }
+        if(c == '\'' && !dq) sq = !sq;
+        else if(c == '"' && !sq) dq = !dq;
+        else if(c == '$' && !sq) return true;
+        else if(!sq && !dq && (c == '*' || c == '?' || c == '[' || c == '{' || (c == '~' && i == 0))) return true;
+    }
+    return false;
+}
+
+static bool is_root_target(std::string t){
+    while(t.size() > 1 && t.back() == '/') t.pop_back();
+    static const char* roots[] = {"/", "/*", "~", "~/*", "$HOME", "${HOME}", "$HOME/*", "/home", "/etc", "/usr", "/var", "/boot", "/bin", "/lib", "/root", "*", ".", ".."};
+    for(const char* r : roots) if(t == r) return true;
+    return false;
+}
+
+struct AiLint {
+    std::vector<std::string> danger, warn;
+};
+
+static AiLint ai_lint_command(const std::string &line){
+    AiLint out;
+    std::string cwd = shell_cwd();
+    auto exists = [&](const std::string &p){
+        struct stat st;
+        std::string full = p[0] == '/' || cwd.empty() ? p : cwd + "/" + p;
+        return stat(full.c_str(), &st) == 0;
+    };
+    auto note = [](std::vector<std::string> &v, const std::string &s){
+        if(std::find(v.begin(), v.end(), s) == v.end()) v.push_back(s);
+    };
+
+    // :(){ :|:& };: and renamed variants
+    std::string compact;
+    for(char c : line) if(!std::isspace((unsigned char)c)) compact.push_back(c);
+    for(size_t p = compact.find("(){"); p != std::string::npos; p = compact.find("(){", p + 1)){
+        size_t s = p;
+        while(s > 0 && !strchr(";&|(){}", compact[s-1])) --s;
+        std::string fn = compact.substr(s, p - s);
+        if(!fn.empty() && compact.find(fn + "|" + fn + "&", p) != std::string::npos) note(out.danger, "fork bomb");
+    }
+
+    std::vector<ShellCommand> cmds = shell_split(line);
+    for(size_t ci = 0; ci < cmds.size(); ++ci){
+        const ShellCommand &c = cmds[ci];
+        size_t k = 0;
+        // skip assignments and wrappers to reach the program that runs
+        while(k < c.argv.size()){
+            const std::string &w = c.argv[k];
+            if(w.find('=') != std::string::npos && w[0] != '=' && w[0] != '-' && c.raw[k].find('=') == w.find('=')){ ++k; continue; }
+            if(w == "sudo" || w == "doas" || w == "nohup" || w == "nice" || w == "time" || w == "env" || w == "exec" || w == "command" || w == "xargs"){
+                ++k;
+                while(k < c.argv.size() && c.argv[k][0] == '-') ++k;
+                continue;
+            }
+            break;
+        }
+        for(const auto &r : c.redirs){
+            if(r.first.find('>') != std::string::npos && r.second.rfind("/dev/", 0) == 0 && r.second != "/dev/null" &&
+               r.second != "/dev/stdout" && r.second != "/dev/stderr" && r.second.rfind("/dev/tty", 0) != 0 && r.second.rfind("/dev/fd/", 0) != 0)
+                note(out.danger, "writes to " + r.second);
+            else if(r.first == "<" && !shell_word_expands(r.second) && !exists(r.second))
+                note(out.warn, "missing: " + r.second);
+            else if(r.first.find('>') != std::string::npos && r.first.find('&') == std::string::npos && !shell_word_expands(r.second)){
+                size_t slash = r.second.find_last_of('/');
+                if(slash != std::string::npos && slash > 0 && !exists(r.second.substr(0, slash))) note(out.warn, "missing: " + r.second.substr(0, slash));
+            }
+        }
+        if(k >= c.argv.size()) continue;
+        const std::string &prog = c.argv[k];
+        std::string base = prog.substr(prog.find_last_of('/') == std::string::npos ? 0 : prog.find_last_of('/') + 1);
+        std::vector<std::string> args;
+        std::vector<bool> args_expand, args_quoted;
+        bool recursive = false, no_preserve = false;
+        for(size_t a = k + 1; a < c.argv.size(); ++a){
+            const std::string &w = c.argv[a];
+            if(w.size() > 1 && w[0] == '-'){
+                if(w == "--recursive" || (w[1] != '-' && w.find_first_of("rR") != std::string::npos)) recursive = true;
+                if(w == "--no-preserve-root") no_preserve = true;
+                continue;
+            }
+            args.push_back(w);
+            args_expand.push_back(shell_word_expands(c.raw[a]));
+            args_quoted.push_back(c.raw[a].find_first_of("'\"") != std::string::npos);
+        }
+
+        if(!shell_word_expands(c.raw[k]) && !shell_is_builtin(prog) && !shell_on_path(prog))
+            note(out.warn, "not on PATH: " + prog);
+
+        if(base == "rm"){
+            for(size_t a = 0; a < args.size(); ++a)
+                if(recursive && is_root_target(args[a])) note(out.danger, "recursive delete of " + args[a]);
+            if(no_preserve) note(out.danger, "rm --no-preserve-root");
+            else if(recursive && out.danger.empty()) note(out.warn, "deletes recursively");
+        } else if((base == "chmod" || base == "chown" || base == "chgrp") && recursive){
+            for(size_t a = 1; a < args.size(); ++a) if(is_root_target(args[a])) note(out.danger, base + " -R on " + args[a]);
+        } else if(base == "dd"){
+            for(const std::string &a : args) if(a.rfind("of=/dev/", 0) == 0 && a != "of=/dev/null") note(out.danger, "dd overwrites " + a.substr(3));
+        } else if(base.rfind("mkfs", 0) == 0 || base == "mkswap" || base == "wipefs" || base == "shred" || base == "fdisk" || base == "parted"){
+            note(out.danger, base + " destroys data");
+        } else if((base == "sh" || base == "bash" || base == "zsh" || base == "dash" || base == "python" || base == "python3" || base == "perl") &&
+                  (c.sep == "|" || c.sep == "|&") && ci > 0){
+            const ShellCommand &src = cmds[ci - 1];
+            for(const std::string &w : src.argv) if(w == "curl" || w == "wget" || w == "fetch"){ note(out.danger, w + " piped into " + base); break; }
+        }
+
+        // arguments that name existing files
+        bool all_files = base == "cat" || base == "less" || base == "more" || base == "head" || base == "tail" || base == "wc" ||
+                         base == "diff" || base == "cmp" || base == "file" || base == "stat" || base == "source" || base == "." ||
+                         base == "cd" || base == "rm" || base == "chmod" || base == "chown";
+        bool creates = base == "echo" || base == "printf" || base == "mkdir" || base == "touch" || base == "tee" || base == "git" || base == "wget" || base == "curl" || base == "ln";
+        bool last_is_dest = base == "cp" || base == "mv" || base == "rsync" || base == "scp" || base == "install";
+        for(size_t a = 0; a < args.size(); ++a){
+            const std::string &w = args[a];
+            if(args_expand[a] || creates || w.empty() || w == "-") continue;
+            if(last_is_dest && a + 1 == args.size()) continue;
+            if((base == "chmod" || base == "chown") && a == 0) continue;
+            if(w.find_first_of(":=") != std::string::npos) continue; // host:path, URLs, key=value
+            bool pathlike = !args_quoted[a] && w.find('/') != std::string::npos; // quoted slashes are usually patterns
+            bool numeric = std::all_of(w.begin(), w.end(), ::isdigit);
+            if((pathlike || (all_files && !numeric)) && !exists(w)) note(out.warn, "missing: " + w);
+        }
+    }
+    return out;
+}
+
+// " [DANGER: ...] [check: ...]" in red / yellow, or "" when nothing was found.
+static std::string ai_lint_annotation(const AiLint &l){
+    std::string s;
+    auto join = [](const std::vector<std::string> &v){
+        std::string j;
+        for(const std::string &x : v){ if(!j.empty()) j += "; "; j += x; }
+        return j;
+    };
+    if(!l.danger.empty()) s += " \x1b[31m[DANGER: " + join(l.danger) + "]\x1b[0m";
+    if(!l.warn.empty()) s += " \x1b[33m[check: " + join(l.warn) + "]\x1b[0m";
+    return s;
+}
+
+// ---------- AI: explain last failure ----------
+// Ctrl+Shift+E sends the last command and the tail of what it printed, asking
+// for a corrected command. The context comes from the grid rows below the
+// command, newest first, with trailing blanks trimmed and repeated lines
+// collapsed, and stops at AI_FIX_CONTEXT_TOKENS so prompt evaluation time stays
+// bounded however much the command printed.
+
+// Length of s[0..n) without trailing spaces.
+static size_t rtrim_spaces(const char* s, size_t n){
+#if defined(__SSE2__)
+    const __m128i sp = _mm_set1_epi8(' ');
+    while(n >= 16){
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + n - 16));
+        unsigned other = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)) & 0xFFFFu;
+        if(other) return n - 16 + (size_t)(32 - __builtin_clz(other));
+        n -= 16;
+    }
+#endif
+    while(n > 0 && s[n-1] == ' ') --n;
+    return n;
+}
+
+// Rough BPE token count: a token per ~4 characters of a word, one per symbol.
+static int ai_estimate_tokens(const std::string &s){
+    int tokens = 0, run = 0;
+    for(char c : s){
+        if(std::isalnum((unsigned char)c)){ run++; continue; }
+        tokens += (run + 3) / 4; run = 0;
+        if(c != ' ') tokens++;
+    }
+    return tokens + (run + 3) / 4;
+}
+
+static std::string ai_failure_context(int budget){
+    int first = std::max(last_command_row + 1, 0), last = std::min(cursor_y - 1, ROWS - 1); // current row is the new prompt
+    std::vector<std::string> picked;  // newest first
+    std::unordered_set<std::string> seen;
+    std::string prev;
+    bool prev_picked = false;
+    int repeats = 0;
+    bool cut = last_command_row < 0;
+    auto flush_repeats = [&](){
+        if(repeats > 0 && prev_picked) picked.back() += " [x" + std::to_string(repeats + 1) + "]";
+        repeats = 0;
+    };
+    for(int r = last; r >= first; --r){
+        const std::string &row = termBuf[r];
+        std::string line(row.data(), rtrim_spaces(row.data(), row.size()));
+        if(line.empty()) continue;
+        if(line == prev){ repeats++; continue; }
+        flush_repeats();
+        prev = line;
+        prev_picked = false;
+        if(seen.count(line)) continue;
+        int cost = ai_estimate_tokens(line) + 1;
+        if(cost > budget){ cut = true; break; }
+        budget -= cost;
+        seen.insert(line);
+        picked.push_back(line);
+        prev_picked = true;
+    }
+    flush_repeats();
+    std::string out = cut ? "...\n" : "";
+    for(auto it = picked.rbegin(); it != picked.rend(); ++it) out += *it + "\n";
+    return out;
+}
+
+static void ai_explain_last_failure(){
+    if(last_command.empty()){
+        std::string hint = "[AI] No command to explain yet.";
+        for(char c : hint) process_byte_ansi(c);
+        process_byte_ansi('\n');
+        return;
+    }
+    std::string cmd = last_command.size() > 512 ? last_command.substr(0, 512) : last_command;
+    std::string request = "The command `" + cmd + "` did not work. Suggest a corrected command.\nIts output ended with:\n" +
+                          ai_failure_context(AI_FIX_CONTEXT_TOKENS);
+
+    input_blocked.store(true);
+    {
+        std::lock_guard<std::mutex> lock(ai_mutex);
+        ai_ready = false;
+        ai_request_text = ""; // the fix itself goes to history, not this prompt
+        ai_generation++;
+    }
+    ai_request_started = now_sec();
+    ai_metrics.requests++;
+    run_llm_async(request, false);
+
+    std::string msg = "[AI] Looking at the last failure...";
+    for(char c : msg) process_byte_ansi(c);
+    process_byte_ansi('\n');
+}
+
+// ---------- Keyboard input mode ----------
+// Keys go to the PTY as they are typed, one write each; the tty and the
+// foreground app (readline, vim, less, ...) do editing and echo, and
+// shell_buffer only shadows the line for the AI. While the app reads in
+// canonical mode with echo off (password prompts) the line is edited locally
+// instead, echoed as '*', and sent on Enter.
+static bool shell_buffer_exact = true;  // shadow still matches the app's line (no cursor keys, completion, ...)
+
+static bool pty_local_line_mode(){
+    if(master_fd < 0) return false;
+    termios t;
+    if(tcgetattr(master_fd, &t) != 0) return false;
+    return (t.c_lflag & ICANON) && !(t.c_lflag & ECHO);
+}
+
+// The app left hidden-input mode with a local line pending: hand it over as typed.
+// The hidden text is then dropped from shell_buffer so it never reaches the AI.
+static void flush_local_line(){
+    if(!local_line_active) return;
+    send_key_to_pty(shell_buffer);
+    shell_buffer.clear();
+    local_line_active = false;
+    shell_buffer_exact = false;
+}
+
+// Track what a passthrough key does to the app's line.
+static void shadow_key(const char *bytes, size_t n){
+    if(n == 1 && (unsigned char)bytes[0] >= 0x20 && bytes[0] != 0x7f){ shell_buffer.append(bytes, n); ai_note_edit(); return; }
+    if(n > 1 && (unsigned char)bytes[0] >= 0x80){ shell_buffer.append(bytes, n); ai_note_edit(); return; } // UTF-8
+    switch(n == 1 ? bytes[0] : 0){
+        case 0x7f: case 0x08:
+            while(!shell_buffer.empty() && ((unsigned char)shell_buffer.back() & 0xC0) == 0x80) shell_buffer.pop_back();
+            if(!shell_buffer.empty()) shell_buffer.pop_back();
+            break;
+        case 0x03: case 0x15: shell_buffer.clear(); shell_buffer_exact = true; break; // ^C, ^U
+        case 0x17: {                                                              // ^W
+            size_t e = shell_buffer.find_last_not_of(' ');
+            size_t b = e == std::string::npos ? std::string::npos : shell_buffer.find_last_of(' ', e);
+            shell_buffer.resize(e == std::string::npos ? 0 : (b == std::string::npos ? 0 : b + 1));
+            break;
+        }
+        default: shell_buffer_exact = false; // cursor movement, completion, history, ...
+    }
+    ai_note_edit();
+}
+
+static void send_input(const char *bytes, size_t n){
+    flush_local_line();
+    shadow_key(bytes, n);
+    send_key_to_pty(bytes, n);
+}
+
+static void send_input(const std::string &bytes){
+    send_input(bytes.data(), bytes.size());
+}
+
+// ---------- Clipboard paste ----------
+// Ctrl+Shift+V. The clipboard is copied once, newlines become CR as typed
+// Enter would, and the text is fed into the PTY input queue as the tty drains
+// it: paste_tick waits for the fd to become writable (reading output meanwhile,
+// since a tty that cannot echo stops taking input) for at most
+// PASTE_FRAME_BUDGET per frame, so the window keeps rendering and ^C can abort
+// a runaway paste. With bracketed paste (DECSET 2004) on, the text goes between
+// ESC[200~ and ESC[201~ and an embedded end marker is removed. The paste state
+// itself sits with the PTY input queue, which drops it when the shell goes away.
+
+static bool paste_active(){ return !paste_data.empty() || paste_end_pending; } // until the tty has taken all of it
+
+// Queue paste bytes ahead of keys typed since the paste started, so the paste
+// stays one contiguous run in pty_input that paste_abort can cut out.
+static void paste_queue(const char *p, size_t n){
+    paste_queue_end = std::max(paste_queue_end, pty_input_sent);
+    pty_input.insert(paste_queue_end, p, n);
+    paste_queue_end += n;
+    pty_metrics.sends++;
+    pty_metrics.max_queued = std::max(pty_metrics.max_queued, pty_input_queued());
+}
+
+static void paste_text(const std::string &text){
+    if(text.empty() || master_fd < 0 || paste_active()) return;
+    flush_local_line();
+    paste_data.clear();
+    paste_data.reserve(text.size());
+    paste_bracketed = term_modes.bracketed_paste;
+    for(size_t i = 0; i < text.size(); ++i){
+        if(text[i] == '\r' && i + 1 < text.size() && text[i + 1] == '\n') continue;
+        if(paste_bracketed && text.compare(i, 6, "\x1b[201~") == 0){ i += 5; continue; }
+        paste_data.push_back(text[i] == '\n' ? '\r' : text[i]);
+    }
+    paste_sent = 0;
+    if(paste_data.find('\r') == std::string::npos && paste_data.size() < 4096 && !pty_local_line_mode()) shell_buffer += paste_data;
+    else shell_buffer_exact = false; // hidden input is not shadowed for the AI
+    ai_note_edit();
+    paste_queue_begin = paste_queue_end = pty_input.size();
+    if(paste_bracketed) paste_queue("\x1b[200~", 6);
+    paste_end_pending = paste_bracketed;
+}
+
+static void paste_abort(){
+    if(!paste_active()) return;
+    paste_data.clear();
+    paste_sent = 0;
+    // drop the unwritten paste bytes; keys typed since the paste started stay queued
+    size_t b = std::max(paste_queue_begin, pty_input_sent), e = std::max(paste_queue_end, pty_input_sent);
+    pty_input.erase(b, e - b);
+    paste_queue_end = b;
+    if(paste_end_pending) paste_queue("\x1b[201~", 6);
+    paste_end_pending = false;
+    shell_buffer_exact = false;
+}
+
+static void paste_tick(double budget){
+    if(!paste_active()) return;
+    if(master_fd < 0){ pty_input_drop(); return; }
+    double end = now_sec() + budget;
+    for(;;){
+        size_t n = std::min(pty_input_room(), paste_data.size() - paste_sent);
+        if(n){ paste_queue(paste_data.data() + paste_sent, n); paste_sent += n; }
+        if(paste_sent == paste_data.size() && paste_end_pending && pty_input_room() >= 6){
+            paste_queue("\x1b[201~", 6);
+            paste_end_pending = false;
+        }
+        flush_pty_input();
+        if(paste_sent == paste_data.size() && !paste_end_pending && pty_input_sent >= paste_queue_end){
+            paste_data.clear();
+            paste_data.shrink_to_fit();
+            paste_sent = 0;
+            return;
+        }
+        double left = end - now_sec();
+        if(left <= 0) return;
+        fd_set rf, wf; FD_ZERO(&rf); FD_ZERO(&wf); FD_SET(master_fd, &rf);
+        if(pty_input_queued()) FD_SET(master_fd, &wf);
+        timeval tv = {0, (suseconds_t)(left * 1e6)};
+        if(select(master_fd + 1, &rf, &wf, NULL, &tv) <= 0) return;
+        if(FD_ISSET(master_fd, &rf)) read_master();
+        if(master_fd < 0) return;
+    }
+}
+
+// ---------- Key encoding (xterm) ----------
+// Non-text keys are encoded at compile time for every combination of
+// Shift/Ctrl/Alt, cursor-key mode (DECCKM), keypad mode (DECKPAM) and
+// modifyOtherKeys level 2, so a keystroke costs one table lookup. Modified keys
+// without a legacy encoding use the modifyOtherKeys form CSI 27;m;code~. An
+// empty entry means the key is plain text and arrives through char_callback.
+struct KeySeq { uint8_t len; char bytes[15]; };
+
+static constexpr int key_list[] = {
+    GLFW_KEY_ESCAPE, GLFW_KEY_ENTER, GLFW_KEY_TAB, GLFW_KEY_BACKSPACE,
+    GLFW_KEY_INSERT, GLFW_KEY_DELETE, GLFW_KEY_RIGHT, GLFW_KEY_LEFT, GLFW_KEY_DOWN, GLFW_KEY_UP,
+    GLFW_KEY_PAGE_UP, GLFW_KEY_PAGE_DOWN, GLFW_KEY_HOME, GLFW_KEY_END,
+    GLFW_KEY_F1, GLFW_KEY_F2, GLFW_KEY_F3, GLFW_KEY_F4, GLFW_KEY_F5, GLFW_KEY_F6,
+    GLFW_KEY_F7, GLFW_KEY_F8, GLFW_KEY_F9, GLFW_KEY_F10, GLFW_KEY_F11, GLFW_KEY_F12,
+    GLFW_KEY_KP_0, GLFW_KEY_KP_1, GLFW_KEY_KP_2, GLFW_KEY_KP_3, GLFW_KEY_KP_4,
+    GLFW_KEY_KP_5, GLFW_KEY_KP_6, GLFW_KEY_KP_7, GLFW_KEY_KP_8, GLFW_KEY_KP_9,
+    GLFW_KEY_KP_DECIMAL, GLFW_KEY_KP_DIVIDE, GLFW_KEY_KP_MULTIPLY, GLFW_KEY_KP_SUBTRACT,
+    GLFW_KEY_KP_ADD, GLFW_KEY_KP_ENTER, GLFW_KEY_KP_EQUAL,
+    // printable keys only matter with Ctrl or Alt held
+    GLFW_KEY_SPACE, GLFW_KEY_APOSTROPHE, GLFW_KEY_COMMA, GLFW_KEY_MINUS, GLFW_KEY_PERIOD,
+    GLFW_KEY_SLASH, GLFW_KEY_SEMICOLON, GLFW_KEY_EQUAL, GLFW_KEY_LEFT_BRACKET,
+    GLFW_KEY_BACKSLASH, GLFW_KEY_RIGHT_BRACKET, GLFW_KEY_GRAVE_ACCENT,
+    GLFW_KEY_0, GLFW_KEY_1, GLFW_KEY_2, GLFW_KEY_3, GLFW_KEY_4,
+    GLFW_KEY_5, GLFW_KEY_6, GLFW_KEY_7, GLFW_KEY_8, GLFW_KEY_9,
+    GLFW_KEY_A, GLFW_KEY_B, GLFW_KEY_C, GLFW_KEY_D, GLFW_KEY_E, GLFW_KEY_F, GLFW_KEY_G,
+    GLFW_KEY_H, GLFW_KEY_I, GLFW_KEY_J, GLFW_KEY_K, GLFW_KEY_L, GLFW_KEY_M, GLFW_KEY_N,
+    GLFW_KEY_O, GLFW_KEY_P, GLFW_KEY_Q, GLFW_KEY_R, GLFW_KEY_S, GLFW_KEY_T, GLFW_KEY_U,
+    GLFW_KEY_V, GLFW_KEY_W, GLFW_KEY_X, GLFW_KEY_Y, GLFW_KEY_Z,
+};
+static constexpr int KEY_LIST_SIZE = sizeof(key_list) / sizeof(key_list[0]);
+static constexpr int KEY_VARIANTS = 8; // app cursor | app keypad << 1 | modifyOtherKeys 2 << 2
+
+struct KeySeqBuilder {
+    KeySeq s{};
+    constexpr void put(char c){ if(s.len < sizeof(s.bytes)) s.bytes[s.len++] = c; }
+    constexpr void put(const char *p){ while(*p) put(*p++); }
+    constexpr void num(int n){ if(n >= 10) num(n / 10); put((char)('0' + n % 10)); }
+    constexpr void other_keys(int m, int code){ put("\x1b[27;"); num(m); put(';'); num(code); put('~'); }
+};
+
+// US layout character of a printable key, unshifted and shifted.
+static constexpr char key_char(int key, bool shift){
+    if(key >= GLFW_KEY_A && key <= GLFW_KEY_Z) return (char)((shift ? 'A' : 'a') + key - GLFW_KEY_A);
+    if(key >= GLFW_KEY_0 && key <= GLFW_KEY_9) return shift ? ")!@#$%^&*("[key - GLFW_KEY_0] : (char)key;
+    switch(key){
+        case GLFW_KEY_SPACE:         return ' ';
+        case GLFW_KEY_APOSTROPHE:    return shift ? '"' : '\'';
+        case GLFW_KEY_COMMA:         return shift ? '<' : ',';
+        case GLFW_KEY_MINUS:         return shift ? '_' : '-';
+        case GLFW_KEY_PERIOD:        return shift ? '>' : '.';
+        case GLFW_KEY_SLASH:         return shift ? '?' : '/';
+        case GLFW_KEY_SEMICOLON:     return shift ? ':' : ';';
+        case GLFW_KEY_EQUAL:         return shift ? '+' : '=';
+        case GLFW_KEY_LEFT_BRACKET:  return shift ? '{' : '[';
+        case GLFW_KEY_BACKSLASH:     return shift ? '|' : '\\';
+        case GLFW_KEY_RIGHT_BRACKET: return shift ? '}' : ']';
+        case GLFW_KEY_GRAVE_ACCENT:  return shift ? '~' : '`';
+        default:                     return 0;
+    }
+}
+
+// Legacy Ctrl encoding of a printable key (letters, the VT220 Ctrl+digit row, [ \ ] / space), or -1.
+static constexpr int key_ctrl_code(int key){
+    if(key >= GLFW_KEY_A && key <= GLFW_KEY_Z) return key - GLFW_KEY_A + 1;
+    switch(key){
+        case GLFW_KEY_SPACE: case GLFW_KEY_2:            return 0x00;
+        case GLFW_KEY_LEFT_BRACKET: case GLFW_KEY_3:     return 0x1b;
+        case GLFW_KEY_BACKSLASH: case GLFW_KEY_4:        return 0x1c;
+        case GLFW_KEY_RIGHT_BRACKET: case GLFW_KEY_5:    return 0x1d;
+        case GLFW_KEY_6:                                 return 0x1e;
+        case GLFW_KEY_SLASH: case GLFW_KEY_7:            return 0x1f;
+        case GLFW_KEY_8:                                 return 0x7f;
+        default:                                         return -1;
+    }
+}
+
+static constexpr KeySeq key_encode(int key, int mods, bool app_cursor, bool app_keypad, bool other_keys){
+    KeySeqBuilder b;
+    bool shift = mods & GLFW_MOD_SHIFT, ctrl = mods & GLFW_MOD_CONTROL, alt = mods & GLFW_MOD_ALT;
+    int m = 1 + (shift ? 1 : 0) + (alt ? 2 : 0) + (ctrl ? 4 : 0); // xterm modifier parameter
+
+    char cursor = key == GLFW_KEY_UP ? 'A' : key == GLFW_KEY_DOWN ? 'B' : key == GLFW_KEY_RIGHT ? 'C' :
+                  key == GLFW_KEY_LEFT ? 'D' : key == GLFW_KEY_HOME ? 'H' : key == GLFW_KEY_END ? 'F' : 0;
+    if(cursor){
+        if(m > 1){ b.put("\x1b[1;"); b.num(m); }
+        else b.put(app_cursor ? "\x1bO" : "\x1b[");
+        b.put(cursor);
+        return b.s;
+    }
+    if(key >= GLFW_KEY_F1 && key <= GLFW_KEY_F4){
+        if(m > 1){ b.put("\x1b[1;"); b.num(m); }
+        else b.put("\x1bO");
+        b.put("PQRS"[key - GLFW_KEY_F1]);
+        return b.s;
+    }
+    constexpr int f5_codes[] = {15, 17, 18, 19, 20, 21, 23, 24};
+    int tilde = key == GLFW_KEY_INSERT ? 2 : key == GLFW_KEY_DELETE ? 3 :
+                key == GLFW_KEY_PAGE_UP ? 5 : key == GLFW_KEY_PAGE_DOWN ? 6 :
+                (key >= GLFW_KEY_F5 && key <= GLFW_KEY_F12) ? f5_codes[key - GLFW_KEY_F5] : 0;
+    if(tilde){
+        b.put("\x1b["); b.num(tilde);
+        if(m > 1){ b.put(';'); b.num(m); }
+        b.put('~');
+        return b.s;
+    }
+    if(key >= GLFW_KEY_KP_0 && key <= GLFW_KEY_KP_EQUAL){
+        if(app_keypad && m == 1){ b.put("\x1bO"); b.put("pqrstuvwxynojmkMX"[key - GLFW_KEY_KP_0]); return b.s; }
+        if(key != GLFW_KEY_KP_ENTER) return b.s; // digits and operators are text
+        key = GLFW_KEY_ENTER;
+    }
+
+    if(key == GLFW_KEY_ENTER || key == GLFW_KEY_TAB || key == GLFW_KEY_BACKSPACE || key == GLFW_KEY_ESCAPE){
+        char c0 = key == GLFW_KEY_ENTER ? '\r' : key == GLFW_KEY_TAB ? '\t' : key == GLFW_KEY_BACKSPACE ? 0x7f : 0x1b;
+        if(key == GLFW_KEY_TAB && m == 2){ b.put("\x1b[Z"); return b.s; }
+        if(key == GLFW_KEY_BACKSPACE && ctrl && !shift && !other_keys){ if(alt) b.put('\x1b'); b.put('\x08'); return b.s; }
+        if(ctrl || (shift && other_keys)){ b.other_keys(m, key == GLFW_KEY_BACKSPACE ? 127 : c0); return b.s; }
+        if(alt) b.put('\x1b');
+        b.put(c0);
+        return b.s;
+    }
+
+    char c = key_char(key, shift);
+    if(!c || (!ctrl && !alt)) return b.s;
+    int c0 = key_ctrl_code(key);
+    if(other_keys || (ctrl && (c0 < 0 || (shift && !(key >= GLFW_KEY_A && key <= GLFW_KEY_Z))))){
+        b.other_keys(m, (unsigned char)c);
+        return b.s;
+    }
+    if(alt) b.put('\x1b');
+    b.put(ctrl ? (char)c0 : c);
+    return b.s;
+}
+
+struct KeyIndex { uint8_t of[GLFW_KEY_LAST + 1]; };
+struct KeyTable { KeySeq seq[(KEY_LIST_SIZE + 1) * 8 * KEY_VARIANTS]; }; // row 0: keys not in key_list
+
+static constexpr KeyIndex make_key_index(){
+    KeyIndex k{};
+    for(int i = 0; i < KEY_LIST_SIZE; ++i) k.of[key_list[i]] = (uint8_t)(i + 1);
+    return k;
+}
+
+// Each key depends on at most one mode bit, so encode it twice and fan out.
+static constexpr KeyTable make_key_table(){
+    KeyTable t{};
+    for(int i = 0; i < KEY_LIST_SIZE; ++i){
+        int key = key_list[i];
+        int bit = (key >= GLFW_KEY_RIGHT && key <= GLFW_KEY_UP) || key == GLFW_KEY_HOME || key == GLFW_KEY_END ? 1 :
+                  key >= GLFW_KEY_KP_0 && key <= GLFW_KEY_KP_EQUAL ? 2 : 4;
+        for(int mods = 0; mods < 8; ++mods){
+            KeySeq off = key_encode(key, mods, false, false, false);
+            KeySeq on = key_encode(key, mods, bit == 1, bit == 2, bit == 4);
+            for(int v = 0; v < KEY_VARIANTS; ++v) t.seq[((i + 1) * 8 + mods) * KEY_VARIANTS + v] = v & bit ? on : off;
+        }
+    }
+    return t;
+}
+
+static constexpr KeyIndex key_index = make_key_index();
+static constexpr KeyTable key_table = make_key_table();
+
+// In application keypad mode a keypad key is sent as SS3 from key_callback;
+// GLFW still delivers its text, which char_callback must then drop.
+static unsigned int keypad_char_sent = 0;
+
+static const KeySeq &key_lookup(int key, int mods){
+    int k = (unsigned)key <= GLFW_KEY_LAST ? key_index.of[key] : 0;
+    int v = term_modes.app_cursor | term_modes.app_keypad << 1 | (term_modes.modify_other_keys >= 2) << 2;
+    return key_table.seq[(k * 8 + (mods & 7)) * KEY_VARIANTS + v];
+}
+
+// ---------- Interrupt fast-forward ----------
+// Normally output is parsed one read per frame, so after ^C a flooding program
+// (yes, a runaway log) keeps scrolling past for as long as its backlog lasts.
+// Once ^C is sent, the next frame instead drains the PTY, flushing queued input
+// between reads, and parses everything that is already waiting for up to
+// INTERRUPT_DRAIN_BUDGET: the screen state stays exact but only the final
+// screenful is ever rendered. That budget is spent once per ^C; a program that
+// traps SIGINT (or ssh, which forwards it) and keeps printing falls back to
+// normal frames afterwards.
+static double interrupt_at = -1;            // ^C sent, drain frame not yet run
+static bool interrupt_fast_forward = true;
+
+static void interrupt_tick(){
+    if(interrupt_at < 0) return;
+    double end = now_sec() + INTERRUPT_DRAIN_BUDGET;
+    while(interrupt_fast_forward){
+        flush_pty_input();
+        if(!read_master()){
+            record_us(interrupt_drain, now_sec() - interrupt_at);
+            break;
+        }
+        if(now_sec() > end) break; // still flooding: give up for this ^C
+    }
+    interrupt_at = -1;
+}
+
+// ---------- Flood mode ----------
+// Output is parsed one read per frame while the program is interactive. When
+// more is already waiting than one read takes (cat of a big file, a build log)
+// the frame instead parses for up to FLOOD_FRAME_BUDGET and renders only where
+// it ended, skipping scroll states nobody could see. The backlog is checked
+// every frame, so the terminal drops back to per-frame reads as soon as the
+// flood stops. CEREBRO_FLOOD=0 turns it off.
+static bool flood_enabled = true;
+
+static void read_output(){
+    int backlog = 0;
+    if(master_fd >= 0 && ioctl(master_fd, FIONREAD, &backlog) != 0) backlog = 0;
+    if(!flood_enabled || backlog < FLOOD_BACKLOG){ read_master(); return; }
+    pty_metrics.flood_frames++;
+    double end = now_sec() + FLOOD_FRAME_BUDGET;
+    while(read_master() && now_sec() < end) flush_pty_input();
+}
+
+// ---------- Synchronized output (DEC mode 2026) ----------
+// Between CSI ? 2026 h and CSI ? 2026 l a program (vim, htop, lazygit) is
+// redrawing in several writes; the renderer keeps showing the last complete
+// frame instead of rebuilding and uploading each partial one. A program that
+// never ends the update is cut off after SYNC_UPDATE_TIMEOUT.
+static double sync_update_since = -1;
+
+static bool sync_update_hold(double now){
+    if(!term_modes.sync_update){ sync_update_since = -1; return false; }
+    if(sync_update_since < 0) sync_update_since = now;
+    if(now - sync_update_since < SYNC_UPDATE_TIMEOUT) return true;
+    term_modes.sync_update = false;
+    sync_update_since = -1;
+    return false;
+}
+
+// ---------- Predictive local echo ----------
+// In passthrough mode a typed character is drawn at once, after any still
+// unconfirmed ones, and put_char_local confirms or rolls it back when the echo
+// arrives. Only plain appends at the end of a line are predicted (not after
+// cursor keys or completion), and not in full-screen programs (alternate screen
+// or application cursor keys) or with echo off. Guesses still unconfirmed after
+// PREDICT_DIM_AFTER are dimmed; after PREDICT_TIMEOUT they are withdrawn.
+static bool predict_enabled(){
+    return predictive_echo && shell_buffer_exact && !term_modes.alt_screen && !term_modes.app_cursor && !pty_local_line_mode();
+}
+
+static void predict_char(char ch){
+    int col = predictions.empty() ? cursor_x : predictions.back().col + 1;
+    int row = predictions.empty() ? cursor_y : predictions.back().row;
+    if(col >= COLS - 1 || row < 0 || row >= ROWS) return; // leave wrapping to the program
+    predictions.push_back(PredictedCell{row, col, ch, termBuf[row][col], termColor[row][col], now_sec(), false});
+    termBuf[row][col] = ch;
+    termColor[row][col] = cur_fg;
+}
+
+static void predict_tick(double now){
+    if(predictions.empty()) return;
+    if(now - predictions.front().at > PREDICT_TIMEOUT){ predict_rollback(); return; }
+    for(PredictedCell &p : predictions){
+        if(p.dimmed || now - p.at < PREDICT_DIM_AFTER) continue;
+        Color &c = termColor[p.row][p.col];
+        c = Color{c.r * 0.55f, c.g * 0.55f, c.b * 0.55f};
+        p.dimmed = true;
+    }
+}
+
+// ---------- Input helpers to update shell_buffer and visual line ----------
+// Local (hidden-input) line only.
+static void append_to_shell_buffer(char ch){
+    shell_buffer.push_back(ch);
+    local_line_active = true;
+    put_char_local('*'); // the app has echo off: show that a key landed, not which
+}
+static void shell_backspace(){
+    if(!shell_buffer.empty()){
+        shell_buffer.pop_back();
+        // visual backspace: move cursor back and clear char
+        if(cursor_x>0){
+            cursor_x--;
+            termBuf[cursor_y][cursor_x] = ' ';
+            termColor[cursor_y][cursor_x] = cur_fg;
+        }
+    }
+}
+
+// ---------- Input callbacks ----------
+static void char_callback(GLFWwindow*, unsigned int codepoint){
+    // codepoint is a Unicode scalar value, sent on as UTF-8
+    if(input_blocked.load()) return; // ignore while awaiting confirm or blocked
+
+    if(codepoint == '\r' || codepoint == '\n') return; // handled in key_callback
+    if(codepoint == keypad_char_sent){ keypad_char_sent = 0; return; }
+    if(pty_local_line_mode()){
+        if(codepoint == 0x7f) shell_backspace();
+        else append_to_shell_buffer(codepoint < 128 ? (char)codepoint : '?');
+        return;
+    }
+    std::string bytes;
+    utf8_append(bytes, codepoint);
+    bool predict = codepoint >= 0x20 && codepoint < 0x7f && predict_enabled();
+    send_input(bytes);
+    if(predict) predict_char((char)codepoint);
+}
+
+static void key_callback(GLFWwindow* window, int key, int, int action, int mods)
+{
+    if (!(action == GLFW_PRESS || action == GLFW_REPEAT)) return;
+    keypad_char_sent = 0;
+
+    // ============================================================
+    // 1. Awaiting confirmation (AI suggestion)
+    // ============================================================
+    if (awaiting_confirm)
+    {
+        int pick = (key >= GLFW_KEY_1 && key <= GLFW_KEY_9) ? key - GLFW_KEY_1 : -1;
+        if (pick >= (int)pending_ai_cmds.size()) return;
+        if (key == GLFW_KEY_Y || key == GLFW_KEY_N || pick >= 0)
+        {
+            bool yes = (key != GLFW_KEY_N);
+            record_us(ai_metrics.decision, now_sec() - ai_shown_at);
+            (yes ? ai_metrics.accepted : ai_metrics.rejected)++;
+            if (pick > 0) ai_metrics.picked_alternative++;
+
+            {
+                std::lock_guard<std::mutex> lock(ai_mutex);
+
+                if (pick > 0) pending_ai_cmd = pending_ai_cmds[pick];
+
+                if (yes)
+                {
+                    // -------------------------------
+                    // User accepts AI-generated cmd
+                    // -------------------------------
+                    if (!pending_ai_cmd.empty())
+                    {
+                        history_index_record(pending_ai_request, pending_ai_cmd);
+                        if (pick > 0 && !pending_ai_key.empty()) ai_cache_store(pending_ai_key, pending_ai_cmd);
+
+                        // Send to PTY: ^E^U empties the app's line (the request
+                        // text), the app then echoes the command itself
+                        send_key_to_pty("\x05\x15" + pending_ai_cmd + "\r");
+                        shell_buffer.clear();
+                        shell_buffer_exact = true;
+                        ai_note_edit();
+
+                        // Note message
+                        std::string note = "[AI executed] " + pending_ai_cmd;
+                        for (char c : note) process_byte_ansi(c);
+                        last_command = pending_ai_cmd;
+                        last_command_row = cursor_y;
+                        process_byte_ansi('\n');
+                    }
+                }
+                else
+                {
+                    // -------------------------------
+                    // User CANCELLED AI suggestion
+                    // -------------------------------
+                    ai_last_rejected = normalize_ai_request(pending_ai_request);
+                    if (!pending_ai_key.empty()) ai_cache_erase(pending_ai_key);
+                    std::string note = "[AI cancelled]";
+                    for (char c : note) process_byte_ansi(c);
+                    process_byte_ansi('\n');
+
+                    // Send Ctrl+C to reset the prompt
+                    send_input(std::string(1, 3)); // ASCII 3 == ^C
+
+                    // Visual ^C (optional)
+                    process_byte_ansi('^');
+                    process_byte_ansi('C');
+                    process_byte_ansi('\n');
+                }
+
+                pending_ai_cmd.clear();
+                pending_ai_cmds.clear();
+                pending_ai_key.clear();
+                ai_generation++;
+            }
+
+            awaiting_confirm = false;
+            input_blocked.store(false);
+            return;
+        }
+
+        // Ignore all other keys during confirmation
+        return;
+    }
+
+    // ============================================================
+    // 1b. AI request pending ("[AI] Thinking..."): the request text is
+    //     still on the app's line, so no key may reach the PTY. Esc or
+    //     Ctrl+C cancels the request; everything else is dropped.
+    // ============================================================
+    if (input_blocked.load())
+    {
+        if (key == GLFW_KEY_ESCAPE || (key == GLFW_KEY_C && (mods & GLFW_MOD_CONTROL)))
+        {
+            {
+                std::lock_guard<std::mutex> lock(ai_mutex);
+                ai_ready = false;
+                ai_generation++; // a late answer is no longer delivered
+            }
+            input_blocked.store(false);
+            std::string note = "[AI cancelled]";
+            for (char c : note) process_byte_ansi(c);
+            process_byte_ansi('\n');
+        }
+        return;
+    }
+
+    // ============================================================
+    // 2. Shift+Enter triggers AI
+    // ============================================================
+    if (key == GLFW_KEY_ENTER && (mods & GLFW_MOD_SHIFT))
+    {
+        if (pty_local_line_mode() || local_line_active)
+        {
+            std::string hint = "[AI] Not available while input is hidden.";
+            for (char c : hint) process_byte_ansi(c);
+            process_byte_ansi('\n');
+            return;
+        }
+
+        std::string current_line = shell_buffer;
+
+        size_t p = current_line.find_first_not_of(' ');
+        if (p != std::string::npos)
+            current_line = current_line.substr(p);
+
+        if (current_line.empty())
+        {
+            std::string hint = "[AI] Nothing to send (empty line).";
+            for (char c : hint) process_byte_ansi(c);
+            process_byte_ansi('\n');
+            return;
+        }
+
+        input_blocked.store(true);
+
+        {
+            std::lock_guard<std::mutex> lock(ai_mutex);
+            ai_ready = false;
+            ai_request_text = current_line;
+            ai_generation++;
+        }
+        ai_request_started = now_sec();
+        ai_metrics.requests++;
+
+        run_llm_async(current_line);
+
+        std::string msg = "[AI] Thinking...";
+        for (char c : msg) process_byte_ansi(c);
+        process_byte_ansi('\n');
+
+        return;
+    }
+
+    // ============================================================
+    // 2b. Ctrl+Shift+M dumps AI metrics into the terminal
+    // ============================================================
+    if (key == GLFW_KEY_M && (mods & GLFW_MOD_CONTROL) && (mods & GLFW_MOD_SHIFT))
+    {
+        process_byte_ansi('\n');
+        for (const std::string &line : ai_metrics_dump_lines())
+        {
+            for (char c : line) process_byte_ansi(c);
+            process_byte_ansi('\n');
+        }
+        return;
+    }
+
+    // ============================================================
+    // 2c. Ctrl+Shift+E asks the AI to fix the last command
+    // ============================================================
+    if (key == GLFW_KEY_E && (mods & GLFW_MOD_CONTROL) && (mods & GLFW_MOD_SHIFT))
+    {
+        ai_explain_last_failure();
+        return;
+    }
+
+    // ============================================================
+    // 2d. Ctrl+Shift+V pastes the clipboard
+    // ============================================================
+    if (key == GLFW_KEY_V && (mods & GLFW_MOD_CONTROL) && (mods & GLFW_MOD_SHIFT))
+    {
+        const char* clip = glfwGetClipboardString(window);
+        if (clip) paste_text(clip);
+        return;
+    }
+
+    // ============================================================
+    // 3. Regular Enter
+    // ============================================================
+    if ((key == GLFW_KEY_ENTER || (key == GLFW_KEY_KP_ENTER && !term_modes.app_keypad)) && mods == 0)
+    {
+        if (pty_local_line_mode())
+        {
+            // hidden input: hand the whole line over; never recorded
+            send_key_to_pty(shell_buffer + "\n");
+            process_byte_ansi('\n');
+            shell_buffer.clear();
+            local_line_active = false;
+            return;
+        }
+        flush_local_line();
+        size_t p = shell_buffer.find_first_not_of(' ');
+        if (p != std::string::npos)
+        {
+            if (shell_buffer_exact) history_index_record("", shell_buffer.substr(p));
+            if (shell_buffer_exact) last_command = shell_buffer.substr(p);
+            else last_command = std::string(termBuf[cursor_y].data(), rtrim_spaces(termBuf[cursor_y].data(), termBuf[cursor_y].size()));
+            last_command_row = cursor_y;
+        }
+        send_key_to_pty("\r");
+        shell_buffer.clear();
+        shell_buffer_exact = true;
+        ai_note_edit();
+        return;
+    }
+
+    // ============================================================
+    // 4. Hidden input: edit the local line
+    // ============================================================
+    if (pty_local_line_mode() && mods == 0 && (key == GLFW_KEY_BACKSPACE || key == GLFW_KEY_TAB))
+    {
+        if (key == GLFW_KEY_BACKSPACE) shell_backspace();
+        else append_to_shell_buffer('\t');
+        return;
+    }
+    if ((mods & GLFW_MOD_CONTROL) && key == GLFW_KEY_C)
+    {
+        paste_abort();
+        interrupt_at = now_sec();
+    }
+    if (local_line_active && (mods & GLFW_MOD_CONTROL) && (key == GLFW_KEY_C || key == GLFW_KEY_U))
+    {
+        shell_buffer.clear(); // drop the hidden line rather than sending it first
+        local_line_active = false;
+    }
+
+    // ============================================================
+    // 5. Everything else: xterm encoding (Esc, cursor/editing keys,
+    //    F1-F12, keypad, Ctrl/Alt combinations)
+    // ============================================================
+    const KeySeq &seq = key_lookup(key, mods);
+    if (seq.len) send_input(seq.bytes, seq.len);
+    if (seq.len && key >= GLFW_KEY_KP_0 && key <= GLFW_KEY_KP_EQUAL)
+        keypad_char_sent = (unsigned char)"0123456789./*-+\r="[key - GLFW_KEY_KP_0];
+}
+
+// Main-thread half of the AI path: show a finished result and enter the confirm state.
+static bool ai_poll_result(){
+    std::lock_guard<std::mutex> g(ai_mutex);
+    if(!ai_ready) return false;
+    if(awaiting_confirm && ai_result == pending_ai_cmd){
+        // model refinement agreed with the local answer already shown
+    } else if(!ai_result.empty()){
+        // lock input and ask confirm
+        const char* origin = awaiting_confirm ? "refined" : ai_origin;
+        if(!awaiting_confirm) record_us(ai_metrics.to_suggestion, now_sec() - ai_request_started);
+        ai_shown_at = now_sec();
+        input_blocked.store(true);
+        pending_ai_cmd = ai_result;
+        pending_ai_cmds.assign(1, ai_result);
+        pending_ai_cmds.insert(pending_ai_cmds.end(), ai_alternatives.begin(), ai_alternatives.end());
+        pending_ai_request = ai_request_text;
+        pending_ai_key = ai_result_key;
+        awaiting_confirm = true;
+
+        double lint_start = now_sec();
+        std::vector<std::string> notes;
+        for(const std::string &cmd : pending_ai_cmds) notes.push_back(ai_lint_annotation(ai_lint_command(cmd)));
+        record_us(ai_metrics.lint, now_sec() - lint_start);
+
+        std::string sug = std::string(*origin ? "[AI suggestion, " + std::string(origin) + "] " : "[AI suggestion] ") + ai_result + notes[0];
+        for(char c : sug) process_byte_ansi(c);
+        process_byte_ansi('\n');
+        for(size_t i=1;i<pending_ai_cmds.size();++i){
+            std::string alt = "  " + std::to_string(i + 1) + ") " + pending_ai_cmds[i] + notes[i];
+            for(char c : alt) process_byte_ansi(c);
+            process_byte_ansi('\n');
+        }
+
+        std::string q = pending_ai_cmds.size() > 1 ? "Execute? (y/n, 1-" + std::to_string(pending_ai_cmds.size()) + " to pick)" : "Execute? (y/n)";
+        for(char c : q) process_byte_ansi(c);
+        process_byte_ansi('\n');
+    }
+    ai_ready = false;
+    ai_result.clear();
+    ai_result_key.clear();
+    ai_alternatives.clear();
+    return true;
+}
+
+static void ai_config_from_env(){
+    if(const char* e = getenv("CEREBRO_AI_PREFETCH")) ai_prefetch = (atoi(e) != 0);
+    if(const char* e = getenv("CEREBRO_AI_REFINE")) ai_refine = (atoi(e) != 0);
+    if(const char* e = getenv("CEREBRO_AI_CANDIDATES")) ai_candidates = std::clamp(atoi(e), 1, AI_MAX_CANDIDATES);
+    if(const char* e = getenv("CEREBRO_AI_WARMUP")) ai_warmup_enabled = (atoi(e) != 0);
+    if(const char* e = getenv("CEREBRO_AI_MAX_INFLIGHT")) ai_max_inflight = std::max(1, atoi(e));
+    if(const char* e = getenv("CEREBRO_AI_DOCS")) ai_docs = (atoi(e) != 0);
+    if(const char* e = getenv("CEREBRO_AI_DOCS_HELP")) ai_docs_help = (atoi(e) != 0);
+    if(const char* e = getenv("CEREBRO_AI_ROUTER")) ai_router.enabled = (atoi(e) != 0);
+    if(const char* e = getenv("CEREBRO_AI_MODEL_SMALL")) ai_router.small = e;
+    if(const char* e = getenv("CEREBRO_AI_MODEL_LARGE")) ai_router.large = e;
+    if(const char* e = getenv("CEREBRO_AI_ROUTE_COMPLEXITY")) ai_router.complexity_threshold = atof(e);
+    if(const char* e = getenv("CEREBRO_AI_ROUTE_CONFIDENCE")) ai_router.confidence_threshold = atof(e);
+}
+
+// ---------- AI latency benchmark (--bench-ai N) ----------
+// Headless: drives N requests through the real input path (char/key callbacks,
+// worker thread, output parsing, suggestion display, 'y' confirm) against the
+// mock backend unless CEREBRO_AI_BACKEND says otherwise. Cache and history files
+// go to a scratch directory so the user's are not touched.
+static double percentile(std::vector<double> v, double p){
+    if(v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)std::min<double>(v.size() - 1, std::floor(p / 100.0 * (v.size() - 1) + 0.5));
+    return v[i];
+}
+
+static int run_ai_benchmark(int n){
+    char tmpl[] = "/tmp/cerebro-bench-XXXXXX";
+    if(!mkdtemp(tmpl)){ perror("mkdtemp"); return 1; }
+    setenv("XDG_CACHE_HOME", tmpl, 1);
+    setenv("XDG_DATA_HOME", tmpl, 1);
+    if(!getenv("CEREBRO_AI_BACKEND")) setenv("CEREBRO_AI_BACKEND", "mock", 1);
+    ai_config_from_env();
+    ai_backend_init();
+    ai_cache_open();
+    ai_warm_up_async(); // as at startup; with CEREBRO_MOCK_LOAD_MS the first request may still wait on it
+
+    termBuf.assign(ROWS, std::string(COLS, ' '));
+    termColor.assign(ROWS, std::vector<Color>(COLS, Color{1,1,1}));
+
+    std::vector<double> e2e, model, overhead, confirm;
+    for(int i=0;i<n;++i){
+        std::string req = "bench request " + std::to_string(i);
+        for(char c : req) char_callback(nullptr, (unsigned char)c);
+        double t0 = now_sec();
+        key_callback(nullptr, GLFW_KEY_ENTER, 0, GLFW_PRESS, GLFW_MOD_SHIFT);
+        while(!ai_poll_result()) usleep(100);
+        double shown = now_sec();
+        if(!awaiting_confirm){ std::cerr<<"bench: request "<<i<<" produced no suggestion\n"; return 1; }
+        key_callback(nullptr, GLFW_KEY_Y, 0, GLFW_PRESS, 0);
+        double done = now_sec();
+        double m = ai_last_model_time.load();
+        e2e.push_back(done - t0);
+        model.push_back(m);
+        overhead.push_back(done - t0 - m);
+        confirm.push_back(done - shown);
+    }
+    ai_cache_close();
+    std::string dir = std::string(tmpl) + "/cerebroshell";
+    unlink((dir + "/ai_cache.bin").c_str());
+    unlink((dir + "/ai_history.tsv").c_str());
+    rmdir(dir.c_str());
+    rmdir(tmpl);
+
+    auto row = [](const char* name, const std::vector<double> &v){
+        printf("%-18s p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms  max %9.3f ms\n", name,
+               percentile(v, 50) * 1e3, percentile(v, 90) * 1e3, percentile(v, 99) * 1e3, percentile(v, 100) * 1e3);
+    };
+    printf("backend %s, %d requests\n", ai_backend->name(), n);
+    row("end-to-end", e2e);
+    row("model", model);
+    row("terminal overhead", overhead);
+    row("confirm", confirm);
+    for(const std::string &line : ai_metrics_dump_lines()) printf("%s\n", line.c_str());
+    return 0;
+}
+
+// ---------- Paste benchmark (--bench-paste MB) ----------
+// Headless: pastes MB megabytes of 80-column lines into `cat > file` on a real
+// PTY (echo on, as at a shell prompt) through paste_text/paste_tick, with the
+// frame loop paced at 60 Hz as vsync would, and checks the file afterwards.
+static int run_paste_benchmark(int mb){
+    char path[] = "/tmp/cerebro-paste-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0){ perror("mkstemp"); return 1; }
+    close(fd);
+
+    termBuf.assign(ROWS, std::string(COLS, ' '));
+    termColor.assign(ROWS, std::vector<Color>(COLS, Color{1,1,1}));
+    pid_t pid = forkpty(&master_fd, NULL, NULL, NULL);
+    if(pid < 0){ perror("forkpty"); return 1; }
+    if(pid == 0){
+        execl("/bin/sh", "sh", "-c", "exec cat > \"$1\"", "sh", path, (char*)NULL);
+        _exit(1);
+    }
+    fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+
+    std::string line(79, 'x');
+    line += '\n';
+    std::string text;
+    text.reserve((size_t)mb << 20);
+    while(text.size() + line.size() <= ((size_t)mb << 20)) text += line;
+
+    const double frame = 1.0 / 60;
+    std::vector<double> tick;
+    double t0 = now_sec();
+    paste_text(text);
+    while(paste_active() || pty_input_queued()){
+        double f0 = now_sec();
+        paste_tick(PASTE_FRAME_BUDGET);
+        flush_pty_input();
+        read_master();
+        tick.push_back(now_sec() - f0);
+        while(now_sec() - f0 < frame) usleep(500);
+    }
+    double elapsed = now_sec() - t0;
+    send_key_to_pty("\x04"); // EOF at the start of a line ends cat
+    flush_pty_input();
+    int status = 0;
+    waitpid(pid, &status, 0);
+    struct stat st{};
+    stat(path, &st);
+    unlink(path);
+
+    printf("pasted %d MB in %.2f s: %.1f MB/s over %zu frames, file %s (%lld of %zu bytes)\n", mb, elapsed,
+           text.size() / 1048576.0 / elapsed, tick.size(), (size_t)st.st_size == text.size() ? "complete" : "INCOMPLETE",
+           (long long)st.st_size, text.size());
+    printf("paste work per frame  p50 %6.2f ms  p99 %6.2f ms  max %6.2f ms\n",
+           percentile(tick, 50) * 1e3, percentile(tick, 99) * 1e3, percentile(tick, 100) * 1e3);
+    for(const std::string &l : ai_metrics_dump_lines()) if(l.compare(0, 11, "[PTY input]") == 0) printf("%s\n", l.c_str());
+    return (size_t)st.st_size == text.size() ? 0 : 1;
+}
+
+// ---------- Interrupt benchmark (--bench-interrupt N) ----------
+// Headless: runs `yes` in bash on a real PTY N times, lets it flood for 300 ms
+// with the frame loop paced at 60 Hz, presses Ctrl+C and counts until the
+// prompt is back at the cursor. Done with and without fast-forward.
+static int run_interrupt_benchmark(int n){
+    termBuf.assign(ROWS, std::string(COLS, ' '));
+    termColor.assign(ROWS, std::vector<Color>(COLS, Color{1,1,1}));
+    winsize ws{};
+    ws.ws_row = (unsigned short)ROWS; ws.ws_col = (unsigned short)COLS;
+    pid_t pid = forkpty(&master_fd, NULL, NULL, &ws);
+    if(pid < 0){ perror("forkpty"); return 1; }
+    if(pid == 0){
+        setenv("PS1", "bench$ ", 1);
+        execl("/bin/bash", "bash", "--norc", "--noprofile", "-i", (char*)NULL);
+        _exit(1);
+    }
+    fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+
+    const double frame = 1.0 / 60;
+    auto run_frame = [&](){
+        double f0 = now_sec();
+        flush_pty_input();
+        interrupt_tick();
+        read_master();
+        while(now_sec() - f0 < frame) usleep(500);
+    };
+    auto at_prompt = [](){ return cursor_x >= 7 && termBuf[cursor_y].compare(cursor_x - 7, 7, "bench$ ") == 0; };
+    auto wait_prompt = [&](double limit){
+        double t0 = now_sec();
+        while(!at_prompt() && master_fd >= 0 && now_sec() - t0 < limit) run_frame();
+        return at_prompt();
+    };
+    if(!wait_prompt(5.0)){ std::cerr<<"bench: no prompt from bash\n"; return 1; }
+
+    std::vector<double> times[2];
+    for(int pass = 0; pass < 2; ++pass){
+        interrupt_fast_forward = pass == 1;
+        for(int i=0;i<n;++i){
+            send_key_to_pty("yes\r");
+            double t0 = now_sec();
+            while(now_sec() - t0 < 0.3) run_frame();
+            t0 = now_sec();
+            key_callback(nullptr, GLFW_KEY_C, 0, GLFW_PRESS, GLFW_MOD_CONTROL);
+            if(!wait_prompt(30.0)){ std::cerr<<"bench: no prompt after ^C\n"; return 1; }
+            times[pass].push_back(now_sec() - t0);
+        }
+    }
+    send_key_to_pty("exit\r");
+    flush_pty_input();
+    waitpid(pid, NULL, 0);
+
+    for(int pass = 0; pass < 2; ++pass)
+        printf("^C to prompt under yes, fast-forward %-3s p50 %8.1f ms  p90 %8.1f ms  max %8.1f ms\n", pass ? "on" : "off",
+               percentile(times[pass], 50) * 1e3, percentile(times[pass], 90) * 1e3, percentile(times[pass], 100) * 1e3);
+    return 0;
+}
+
+// ---------- Flood benchmark (--bench-flood MB) ----------
+// Headless: `cat` of an MB megabyte file of 80-column lines on a real PTY, with
+// the frame loop paced at 60 Hz, once with flood mode and once without.
+static int run_flood_benchmark(int mb){
+    char path[] = "/tmp/cerebro-flood-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0){ perror("mkstemp"); return 1; }
+    std::string line(79, 'x');
+    line += '\n';
+    std::string chunk;
+    while(chunk.size() + line.size() <= (1 << 20)) chunk += line;
+    for(int i=0;i<mb;++i) if(write(fd, chunk.data(), chunk.size()) != (ssize_t)chunk.size()){ perror("write"); return 1; }
+    close(fd);
+    double total = (double)mb * chunk.size();
+
+    termBuf.assign(ROWS, std::string(COLS, ' '));
+    termColor.assign(ROWS, std::vector<Color>(COLS, Color{1,1,1}));
+    const double frame = 1.0 / 60;
+    for(int pass = 0; pass < 2; ++pass){
+        flood_enabled = pass == 1;
+        pty_metrics.flood_frames = 0;
+        pid_t pid = forkpty(&master_fd, NULL, NULL, NULL);
+        if(pid < 0){ perror("forkpty"); return 1; }
+        if(pid == 0){
+            execl("/bin/cat", "cat", path, (char*)NULL);
+            _exit(1);
+        }
+        fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+        double t0 = now_sec();
+        size_t frames = 0;
+        bool exited = false;
+        for(;;){
+            double f0 = now_sec();
+            read_output();
+            frames++;
+            if(!exited) exited = waitpid(pid, NULL, WNOHANG) == pid;
+            int backlog = 0;
+            if(exited && (ioctl(master_fd, FIONREAD, &backlog) != 0 || backlog == 0)) break;
+            while(now_sec() - f0 < frame) usleep(500);
+        }
+        double elapsed = now_sec() - t0;
+        close(master_fd);
+        master_fd = -1;
+        printf("cat %d MB, flood mode %-3s %6.2f s  %7.2f MB/s  %zu frames (%llu flooded)\n", mb, pass ? "on" : "off",
+               elapsed, total / 1048576.0 / elapsed, frames, (unsigned long long)pty_metrics.flood_frames);
+    }
+    unlink(path);
+    return 0;
+}
+
+// ---------- Main ----------
+int main(int argc, char** argv){
+    const char* fontpath = "/usr/share/fonts/TTF/HackNerdFontMono-Regular.ttf";
+    if(argc > 2 && strcmp(argv[1], "--bench-ai") == 0) return run_ai_benchmark(std::max(1, atoi(argv[2])));
+    if(argc > 2 && strcmp(argv[1], "--bench-paste") == 0) return run_paste_benchmark(std::max(1, atoi(argv[2])));
+    if(argc > 2 && strcmp(argv[1], "--bench-interrupt") == 0) return run_interrupt_benchmark(std::max(1, atoi(argv[2])));
+    if(argc > 2 && strcmp(argv[1], "--bench-flood") == 0) return run_flood_benchmark(std::max(1, atoi(argv[2])));
+    if(argc > 1) fontpath = argv[1];
+
+    // initial guesses
+    CHAR_W = 10; CHAR_H = 18;
+    int win_w = WINDOW_W, win_h = WINDOW_H;
+    COLS = win_w / CHAR_W; ROWS = win_h / CHAR_H;
+    if(COLS < 10) COLS = 80;
+    if(ROWS < 5) ROWS = 24;
+
+    termBuf.resize(ROWS, std::string(COLS, ' '));
+    termColor.resize(ROWS, std::vector<Color>(COLS, Color{1,1,1}));
+
+    // spawn PTY + shell
+    pid_t pid = forkpty(&master_fd, NULL, NULL, NULL);
+    if(pid < 0){ perror("forkpty"); return 1; }
+    if(pid == 0){
         const char* shell = getenv("SHELL"); if(!shell) shell="/bin/bash";
         execlp(shell, shell, (char*)NULL);
         _exit(1);
     }
+    shell_pid = pid;
+
+    ai_config_from_env();
+    ai_backend_init(); // after the router settings, which the llama backend may override
+    signal(SIGUSR1, [](int){ metrics_dump_requested.store(true); });
+
+    if(const char* e = getenv("CEREBRO_PREDICT")) predictive_echo = (atoi(e) != 0);
+    if(const char* e = getenv("CEREBRO_FLOOD")) flood_enabled = (atoi(e) != 0);
+    doc_index_built_at = now_sec();
+    std::thread([](){
+        if(ai_docs) doc_index_open();
+        history_index_build();
+        if(ai_docs) doc_index_build(); // --help indexing needs the history
+    }).detach();
+
+    ai_cache_open();
     // non-blocking master
     int flags = fcntl(master_fd, F_GETFL, 0);
     fcntl(master_fd, F_SETFL, flags | O_NONBLOCK);
@@ -637,6 +4244,7 @@ int main(int argc, char** argv){
     glfwMakeContextCurrent(window);
     glfwSetCharCallback(window, char_callback);
     glfwSetKeyCallback(window, key_callback);
+    glfwSetWindowFocusCallback(window, focus_callback);
     glfwSwapInterval(1);
 
     if(!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)){ std::cerr<<"glad init failed\n"; return 1; }
@@ -663,6 +4271,8 @@ int main(int argc, char** argv){
 
     termBuf.assign(ROWS, std::string(COLS,' '));
     termColor.assign(ROWS, std::vector<Color>(COLS, Color{1,1,1}));
+    altBuf = termBuf;
+    altColor = termColor;
 
     // VAO/VBO
     glGenVertexArrays(1, &vao); glBindVertexArray(vao);
@@ -682,40 +4292,32 @@ int main(int argc, char** argv){
     // cursor blink
     double last_blink = 0.0;
     bool cursor_visible = true;
+    GLsizei frame_vertices = 0; // in the VBO from the last built frame
 
     // main loop
     while(!glfwWindowShouldClose(window)){
         glfwPollEvents();
-        read_master();
+        paste_tick(PASTE_FRAME_BUDGET);
+        flush_pty_input();
+        interrupt_tick();
+        read_output();
+        ai_prefetch_tick(now_sec());
+        ai_keep_alive_tick(now_sec());
+        doc_index_tick(now_sec());
+        predict_tick(now_sec());
 
         // if AI result ready, show suggestion and ask for confirmation
-        {
-            std::lock_guard<std::mutex> g(ai_mutex);
-            if(ai_ready){
-                if(!ai_result.empty()){
-                    // lock input and ask confirm
-                    input_blocked.store(true);
-                    pending_ai_cmd = ai_result;
-                    awaiting_confirm = true;
-
-                    std::string sug = "[AI suggestion] " + ai_result;
-                    for(char c : sug) process_byte_ansi(c);
-                    process_byte_ansi('\n');
-
-                    std::string q = "Execute? (y/n)";
-                    for(char c : q) process_byte_ansi(c);
-                    process_byte_ansi('\n');
-                }
-                ai_ready = false;
-                ai_result.clear();
-            }
-        }
+        ai_poll_result();
+        if(metrics_dump_requested.exchange(false))
+            for(const std::string &line : ai_metrics_dump_lines()) std::cerr<<line<<"\n";
 
-        // build vertices for entire grid
+        // build vertices for entire grid, unless a synchronized update holds the last frame
+        bool hold = sync_update_hold(now_sec()) && frame_vertices > 0;
+        if(hold) pty_metrics.held_frames++;
         std::vector<float> verts;
-        verts.reserve((size_t)ROWS*COLS*6*7 + 6*7);
+        if(!hold) verts.reserve((size_t)ROWS*COLS*6*7 + 6*7);
 
-        for(int r=0;r<ROWS;++r){
+        for(int r=0;!hold && r<ROWS;++r){
             for(int c=0;c<COLS;++c){
                 unsigned char ch = (unsigned char)termBuf[r][c];
                 if(ch < FIRST_CHAR || ch > LAST_CHAR) ch = '?';
@@ -752,7 +4354,7 @@ int main(int argc, char** argv){
         // cursor
         double now = glfwGetTime();
         if(now - last_blink >= 0.5){ cursor_visible = !cursor_visible; last_blink = now; }
-        if(cursor_visible){
+        if(cursor_visible && !hold){
             float x0 = cursor_x * CHAR_W;
             float y0 = cursor_y * CHAR_H;
             float x1 = x0 + CHAR_W;
@@ -770,13 +4372,16 @@ int main(int argc, char** argv){
         glUniform2f(uniRes, (float)win_w, (float)win_h);
         glBindVertexArray(vao);
         glActiveTexture(GL_TEXTURE0); glBindTexture(GL_TEXTURE_2D, atlasTex);
-        GLsizei vertexCount = (GLsizei)(verts.size() / 7);
+        GLsizei vertexCount = hold ? frame_vertices : (GLsizei)(verts.size() / 7);
+        frame_vertices = vertexCount;
         if(vertexCount > 0) glDrawArrays(GL_TRIANGLES, 0, vertexCount);
 
         glfwSwapBuffers(window);
     }
 
     // cleanup
+    std::cerr<<"[AI cache] "<<ai_cache.hits.load()<<" hits, "<<ai_cache.misses.load()<<" misses\n";
+    ai_cache_close();
     if(master_fd >= 0) close(master_fd);
     glfwDestroyWindow(window);
     glfwTerminate();